@@ -0,0 +1,91 @@
+#include "acktracker.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace std;
+
+AckTracker::AckTracker() { reset(); }
+
+void AckTracker::reset() {
+    m_cumack = -1;
+    m_highest = -1;
+    m_ranges.clear();
+    m_pending = 0;
+}
+
+void AckTracker::ack(seq_t seqno) {
+    // A seqno this far behind can't be from the messenger we have been
+    // talking to, it must have restarted
+    if (seqno < m_cumack - MAX_SEND_WINDOW) reset();
+
+    m_pending++;
+    if (covers(seqno)) return;
+    m_highest = max(m_highest, seqno);
+
+    // Merge with a range ending just below and/or starting just above
+    seq_t first = seqno, last = seqno;
+    auto above = m_ranges.find(seqno + 1);
+    if (above != m_ranges.end()) {
+        last = above->second;
+        m_ranges.erase(above);
+    }
+    auto below = m_ranges.lower_bound(seqno);
+    if (below != m_ranges.begin()) {
+        --below;
+        if (below->second == seqno - 1) {
+            first = below->first;
+            m_ranges.erase(below);
+        }
+    }
+    m_ranges[first] = last;
+
+    advance();
+}
+
+// Forgetting an ACK is always safe, the client just resends and we ACK
+// again. Claiming an SOS'd message was ACK'd is not, so punch a hole.
+void AckTracker::sos(seq_t seqno) {
+    if (seqno <= m_cumack) {
+        if (seqno < m_cumack) m_ranges[seqno + 1] = m_cumack;
+        m_cumack = seqno - 1;
+        return;
+    }
+    auto it = m_ranges.upper_bound(seqno);
+    if (it == m_ranges.begin()) return;
+    --it;
+    seq_t first = it->first, last = it->second;
+    if (seqno > last) return;
+    m_ranges.erase(it);
+    if (first < seqno) m_ranges[first] = seqno - 1;
+    if (seqno < last) m_ranges[seqno + 1] = last;
+}
+
+bool AckTracker::covers(seq_t seqno) {
+    if (seqno <= m_cumack) return true;
+    auto it = m_ranges.upper_bound(seqno);
+    if (it == m_ranges.begin()) return false;
+    --it;
+    return seqno <= it->second;
+}
+
+// Folds ranges into the cumulative ACK where possible
+void AckTracker::advance() {
+    m_cumack = max(m_cumack, m_highest - MAX_SEND_WINDOW);
+    while (!m_ranges.empty()) {
+        auto lowest = m_ranges.begin();
+        if (lowest->first > m_cumack + 1) break;
+        m_cumack = max(m_cumack, lowest->second);
+        m_ranges.erase(lowest);
+    }
+}
+
+Packet AckTracker::toSack() {
+    vector<SackRange> ranges;
+    for (auto &kv_pair : m_ranges) {
+        if ((int)ranges.size() == MAX_SACK_RANGES) break;
+        ranges.push_back({kv_pair.first, kv_pair.second});
+    }
+    m_pending = 0;
+    return Packet().ofSelectiveAck(m_cumack, ranges.data(), ranges.size());
+}
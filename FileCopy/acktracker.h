@@ -0,0 +1,44 @@
+#ifndef ACKTRACKER_H
+#define ACKTRACKER_H
+
+#include <map>
+
+#include "packet.h"
+
+// Server side record of which seqnos we have ACK'd, so that many ACKs can
+// be answered with a single SACK packet.
+//
+// Only ever claims a seqno was ACK'd if it really was, with one exception:
+// the messenger never has messages more than MAX_SEND_WINDOW seqnos apart in
+// flight, so anything that far below the highest seqno seen is folded into
+// the cumulative ACK. That keeps holes the client gave up on (e.g. after an
+// SOS) from stalling the cumulative ACK forever.
+class AckTracker {
+   public:
+    AckTracker();
+
+    // Remember that seqno was ACK'd
+    void ack(seq_t seqno);
+
+    // Make sure seqno is not reported as ACK'd
+    void sos(seq_t seqno);
+
+    // Number of ACKs recorded since the last SACK was built
+    int pending() { return m_pending; }
+
+    // Builds a SACK with the cumulative ACK and the lowest ranges above it,
+    // and resets pending()
+    Packet toSack();
+
+   private:
+    bool covers(seq_t seqno);
+    void reset();
+    void advance();
+
+    seq_t m_cumack;
+    seq_t m_highest;
+    std::map<seq_t, seq_t> m_ranges;  // first -> last, all above m_cumack + 1
+    int m_pending;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#include "arena.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#include "settings.h"
+
+using namespace std;
+
+SectionArena::SectionArena(size_t slotSize) {
+    m_slotSize = max(slotSize, (size_t)1);
+    m_slotsPerSlab = max(ARENA_SLAB_BYTES / m_slotSize, (size_t)1);
+    // aligned to their size, so a slot's slab is its address rounded down
+    m_slabBytes = 1;
+    while (m_slabBytes < m_slotsPerSlab * m_slotSize) m_slabBytes <<= 1;
+    m_current = nullptr;
+    m_spare = nullptr;
+}
+
+SectionArena::~SectionArena() {
+    for (auto &kv_pair : m_slabs) std::free((void *)kv_pair.first);
+    std::free(m_spare);
+}
+
+uint8_t *SectionArena::alloc() {
+    if (!m_current || m_slabs[(uintptr_t)m_current].used == m_slotsPerSlab) {
+        uint8_t *full = m_current;
+        m_current = newSlab();
+        // it was only kept for being current
+        if (full && m_slabs[(uintptr_t)full].live == 0)
+            release((uintptr_t)full);
+    }
+    Slab &slab = m_slabs[(uintptr_t)m_current];
+    uint8_t *slot = m_current + slab.used * m_slotSize;
+    slab.used++;
+    slab.live++;
+    return slot;
+}
+
+void SectionArena::free(uint8_t *slot) {
+    uintptr_t b = base(slot);
+    Slab &slab = m_slabs[b];
+    if (--slab.live == 0 && b != (uintptr_t)m_current) release(b);
+}
+
+uint8_t *SectionArena::newSlab() {
+    uint8_t *slab = m_spare;
+    m_spare = nullptr;
+    if (!slab) slab = (uint8_t *)aligned_alloc(m_slabBytes, m_slabBytes);
+    if (!slab) throw bad_alloc();
+    m_slabs[(uintptr_t)slab] = {0, 0};
+    return slab;
+}
+
+void SectionArena::release(uintptr_t b) {
+    m_slabs.erase(b);
+    if (!m_spare)
+        m_spare = (uint8_t *)b;
+    else
+        std::free((void *)b);
+}
@@ -0,0 +1,55 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+
+// Buffers for the sections of one file, all the same size, carved out of
+// slabs of about ARENA_SLAB_BYTES.
+//
+// Slots are handed out in order from the newest slab, so sections that
+// arrive in order sit next to each other in memory and can be written out
+// with one call. A slab goes back to the heap once every slot in it is
+// freed (one is kept around for the next), and destroying the arena frees
+// every slab at once, so starting a file over costs a handful of frees
+// instead of one per section.
+//
+// Not thread safe: alloc and free from the thread that owns the file.
+class SectionArena {
+   public:
+    // Slots of slotSize bytes
+    explicit SectionArena(size_t slotSize);
+    ~SectionArena();
+
+    SectionArena(const SectionArena &) = delete;
+    SectionArena &operator=(const SectionArena &) = delete;
+
+    size_t slotSize() const { return m_slotSize; }
+
+    uint8_t *alloc();
+
+    // slot must have come from alloc()
+    void free(uint8_t *slot);
+
+   private:
+    struct Slab {
+        uint32_t used;  // slots handed out
+        uint32_t live;  // slots handed out and not yet freed
+    };
+
+    uintptr_t base(uint8_t *slot) const {
+        return (uintptr_t)slot & ~(uintptr_t)(m_slabBytes - 1);
+    }
+    uint8_t *newSlab();
+    void release(uintptr_t base);
+
+    size_t m_slotSize;
+    size_t m_slotsPerSlab;
+    size_t m_slabBytes;  // a power of two, slabs are aligned to it
+    uint8_t *m_current;  // slab slots come from, nullptr if none
+    uint8_t *m_spare;    // an empty slab kept for next time, or nullptr
+    std::unordered_map<uintptr_t, Slab> m_slabs;  // by address
+};
+
+#endif
@@ -0,0 +1,66 @@
+#ifndef CHECKSUMVOTE_H
+#define CHECKSUMVOTE_H
+
+#include <openssl/sha.h>
+
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <unordered_map>
+
+#include "settings.h"
+
+// Majority vote over the checksums of repeated reads of the same data,
+// that can tell when it has seen enough. Each read is taken to be bad with
+// some probability q, estimated from the reads that disagree with the
+// leader (with a Jeffreys prior, so a few agreeing reads don't make it
+// zero). Even if every bad read came back the same way, the leader being
+// wrong is then no likelier than (q / (1 - q)) ^ lead, where lead is how
+// many votes it has over the runner up.
+//
+// With READ_CONFIDENCE 0.999, 4 reads that all agree decide. 3 would leave
+// (1/7) ^ 3 = 0.0029.
+class ChecksumVote {
+   public:
+    ChecksumVote() : m_reads(0), m_high(0), m_second(0) {}
+
+    // Counts a read with checksum. True if checksum now leads.
+    bool add(const unsigned char checksum[SHA_DIGEST_LENGTH]) {
+        std::string key((const char *)checksum, SHA_DIGEST_LENGTH);
+        int votes = ++m_votes[key];
+        m_reads++;
+        if (key == m_leader) {
+            m_high = votes;
+            return true;
+        }
+        if (votes > m_high) {  // counts go up by one, so it was tied
+            m_second = m_high;
+            m_high = votes;
+            m_leader = key;
+            return true;
+        }
+        m_second = std::max(m_second, votes);
+        return false;
+    }
+
+    // True once the leader is right with READ_CONFIDENCE
+    bool decided() const {
+        double q = (m_reads - m_high + 0.5) / (m_reads + 1.0);
+        if (q >= 0.5) return false;
+        return pow(q / (1 - q), m_high - m_second) < 1 - READ_CONFIDENCE;
+    }
+
+    int reads() const { return m_reads; }
+
+    // Reads that didn't agree with the leader
+    int disagreed() const { return m_reads - m_high; }
+
+   private:
+    std::unordered_map<std::string, int> m_votes;
+    std::string m_leader;
+    int m_reads;
+    int m_high;    // votes for m_leader
+    int m_second;  // votes for the runner up
+};
+
+#endif
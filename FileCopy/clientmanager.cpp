@@ -4,12 +4,14 @@
 #include <cstddef>
 
 #include "c150debug.h"
+#include "scheduler.h"
 
 ClientManager::ClientManager(C150NastyFile *nfp, string dir,
                              vector<string> *filenames) {
     assert(nfp && filenames);
     m_nfp = nfp;
     m_dir = dir;
+    m_loadedBytes = 0;
 
     c150debug->printf(C150APPLICATION, "Starting setup of client manager\n");
 
@@ -33,105 +35,109 @@ ClientManager::~ClientManager() {
     }
 }
 
-bool ClientManager::sendFiles(Messenger *m) {
+bool ClientManager::transfer(Messenger *m) {
     assert(m);
 
-    for (auto &kv_pair : m_filemap) {
-        int f_id = kv_pair.first;
-        FileTracker &ft = kv_pair.second;
-
-        // Skip files that have been transfered
-        if (ft.status != LOCALONLY) continue;
-
-        // Read file into memory if not already
-        if (!ft.filedata)
-            ft.filelen = fileToBuffer(m_nfp, makeFileName(m_dir, ft.filename),
-                                      &ft.filedata, ft.checksum);
-
-        // Convert file data to string for sending
-        string data_string = string((char *)ft.filedata, ft.filelen);
-
-        c150debug->printf(C150APPLICATION, "Trying to send file %s\n",
-                          ft.filename.c_str());
-
-        // Send file using messenger
-        bool success = m->sendBlob(data_string, f_id, ft.filename);
+    c150debug->printf(C150APPLICATION, "Starting file transfer\n");
 
-        // Update status based on whether transfer succeeded
-        if (success) {
-            c150debug->printf(C150APPLICATION, "File transfer successful: %s\n",
-                              ft.filename.c_str());
-            ft.status = EXISTSREMOTE;
-            ft.deleteFileData();
-        } else {
-            c150debug->printf(C150APPLICATION, "File transfer failed: %s\n",
-                              ft.filename.c_str());
+    // Start a coroutine per file, as many as memory allows, and run them
+    // in rounds: each round they all go as far as they can, until they
+    // wait on the messenger, which then sends what they asked for together
+    // in one window.
+    Scheduler sched;
+    auto next = m_filemap.begin();
+    while (true) {
+        for (; next != m_filemap.end() && sched.live() < MAX_BATCH_FILES &&
+               m_loadedBytes < MAX_BATCH_BYTES;
+             ++next) {
+            FileTransferStatus status = next->second.status;
+            if (status == COMPLETED || status == FAILED) continue;
+            sched.spawn(copyFile(m, next->first));
+            sched.runReady();  // loads the file, so m_loadedBytes is current
         }
+        if (sched.live() == 0 && next == m_filemap.end()) break;
+        m->flushAsync(sched);
+        sched.runReady();
     }
 
-    // Return false if some files failed to send
-    for (auto &kv_pair : m_filemap) {
-        FileTracker &ft = kv_pair.second;
-        if (ft.status == LOCALONLY) return false;
-    }
-    return true;
-}
-
-void ClientManager::transfer(Messenger *m) {
-    assert(m);
-
-    c150debug->printf(C150APPLICATION, "Starting file transfer\n");
-
-    while (!sendFiles(m))
-        c150debug->printf(C150APPLICATION,
-                          "Some file transfers failed, retrying\n");
-
+    for (auto &kv_pair : m_filemap)
+        if (kv_pair.second.status == FAILED) return false;
     c150debug->printf(C150APPLICATION, "File transfer succeeded\n");
+    return true;
 }
 
-bool ClientManager::endToEndCheck(Messenger *m) {
-    assert(m);
-
-    for (auto &kv_pair : m_filemap) {
-        int f_id = kv_pair.first;
-        FileTracker &ft = kv_pair.second;
-
-        // Skip files that have not been transfered, or already checked
-        if (ft.status != EXISTSREMOTE) continue;
-
-        // Read file into memory if not already
-        if (!ft.filedata)
-            fileToBuffer(m_nfp, makeFileName(m_dir, ft.filename), &ft.filedata,
-                         ft.checksum);
-
-        // Request the file check, then update status
-        Packet check_msg =
-            Packet().ofCheckIsNecessary(f_id, ft.filename, ft.checksum);
-        Packet response;
-        if (m->send_one(check_msg)) {
+Task<> ClientManager::copyFile(Messenger *m, int id) {
+    FileTracker &ft = m_filemap[id];
+    while (ft.status != COMPLETED) {
+        c150debug->printf(C150APPLICATION, "Trying to send file %s\n",
+                          ft.filename.c_str());
+        if (!loadFile(ft)) {
+            fprintf(stderr, "Can't read %s, skipping it\n",
+                    ft.filename.c_str());
+            ft.status = FAILED;
+            co_return;
+        }
+        Messenger::Blob blob = {id, ft.filename, ft.filedata, ft.filelen,
+                                ft.attempted};
+        bool sent = co_await m->sendBlobAsync(blob);
+        ft.attempted = true;
+        if (!sent) {
+            if (++ft.failures == MAX_SOS_COUNT) {
+                fprintf(stderr, "Giving up on %s after %d failed sends\n",
+                        ft.filename.c_str(), ft.failures);
+                unloadFile(ft);
+                ft.status = FAILED;
+                co_return;
+            }
+            c150debug->printf(C150APPLICATION,
+                              "File transfer failed, retrying: %s\n",
+                              ft.filename.c_str());
+            continue;
+        }
+        c150debug->printf(C150APPLICATION, "File transfer successful: %s\n",
+                          ft.filename.c_str());
+        ft.status = EXISTSREMOTE;
+        unloadFile(ft);
+
+        // Read the file again for the checksum, in case the first read was
+        // wrong, then tell the server what to keep
+        loadFile(ft);
+        unloadFile(ft);
+        bool checked = co_await m->checkAsync(id, ft.filename, ft.checksum);
+        if (checked) {
             ft.status = COMPLETED;
-            response = Packet().ofKeepIt(f_id);
+            co_await m->sendAsync(Packet().ofKeepIt(id));
         } else {
+            c150debug->printf(C150APPLICATION,
+                              "End to end check failed, retrying: %s\n",
+                              ft.filename.c_str());
             ft.status = LOCALONLY;
-            response = Packet().ofDeleteIt(f_id);
+            co_await m->sendAsync(Packet().ofDeleteIt(id));
         }
-        m->send_one(response);
-
-        ft.deleteFileData();
     }
+}
 
-    // Return false if some files failed the check
-    for (auto &kv_pair : m_filemap) {
-        FileTracker &ft = kv_pair.second;
-        if (ft.status != COMPLETED) return false;
-    }
+bool ClientManager::loadFile(FileTracker &ft) {
+    if (ft.filedata) return true;
+    ft.filelen = fileToBuffer(m_nfp, makeFileName(m_dir, ft.filename),
+                              &ft.filedata, ft.checksum);
+    if (!ft.filedata) return false;
+    m_loadedBytes += ft.filelen;
     return true;
 }
 
+void ClientManager::unloadFile(FileTracker &ft) {
+    if (!ft.filedata) return;
+    m_loadedBytes -= ft.filelen;
+    ft.deleteFileData();
+}
+
 ClientManager::FileTracker::FileTracker() {
     filedata = nullptr;
     filelen = -1;
     status = LOCALONLY;
+    attempted = false;
+    failures = 0;
     memset(checksum, 0, SHA_DIGEST_LENGTH);
 }
 
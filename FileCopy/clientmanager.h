@@ -6,6 +6,7 @@
 
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "c150dgmsocket.h"
@@ -13,6 +14,7 @@
 #include "diskio.h"
 #include "messenger.h"
 #include "settings.h"
+#include "task.h"
 
 using namespace C150NETWORK;
 using namespace std;
@@ -24,16 +26,19 @@ class ClientManager {
     ClientManager(C150NastyFile *nfp, string dir, vector<string> *filenames);
     ~ClientManager();
 
-    void transfer(Messenger *m);
-
-    // loop through filemap and E2E verify all the files
-    bool endToEndCheck(Messenger *m);
+    // Copies every file and has the server E2E verify it, retrying until
+    // all of them check out. Each file goes through its own state machine
+    // (see copyFile()), many at once. Returns false if some files were
+    // given up on: ones that can't be read, and ones the server wouldn't
+    // take MAX_SOS_COUNT times.
+    bool transfer(Messenger *m);
 
    private:
     enum FileTransferStatus {
         LOCALONLY,
         EXISTSREMOTE,
         COMPLETED,
+        FAILED,  // given up on
     };
 
     struct FileTracker {
@@ -41,6 +46,8 @@ class ClientManager {
         size_t filelen;
         string filename;
         FileTransferStatus status;
+        bool attempted;  // sent before, so the server may have some of it
+        int failures;    // sends that failed
         unsigned char checksum[SHA_DIGEST_LENGTH];
         FileTracker();
         ~FileTracker();
@@ -53,9 +60,19 @@ class ClientManager {
     C150NastyFile *m_nfp;
     string m_dir;
 
-    // loop through filemap and send all the files
-    // returns false if some files reached the SOS limit
-    bool sendFiles(Messenger *m);
+    // bytes of file data in memory, bounds the number of files in progress
+    size_t m_loadedBytes;
+
+    // One file's state machine, as a coroutine: PREPARE_FOR_BLOB (or
+    // RESUME_BLOB) and the sections, then CHECK_IS_NECESSARY, then KEEP_IT
+    // or DELETE_IT, and again from the top until the check passes or the
+    // file is given up on
+    Task<> copyFile(Messenger *m, int id);
+
+    // Reads the file into memory (if not already), computing its checksum.
+    // False if it can't be read.
+    bool loadFile(FileTracker &ft);
+    void unloadFile(FileTracker &ft);
 };
 
 #endif
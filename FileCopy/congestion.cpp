@@ -0,0 +1,104 @@
+#include "congestion.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// Vegas thresholds, in messages queued in the network
+#define VEGAS_ALPHA 2
+#define VEGAS_BETA 4
+
+static double clampWindow(double cwnd) {
+    return max((double)MIN_SEND_WINDOW, min(cwnd, (double)MAX_SEND_WINDOW));
+}
+
+/*
+ * Reno
+ */
+
+RenoController::RenoController() {
+    m_cwnd = INITIAL_SEND_WINDOW;
+    m_ssthresh = MAX_SEND_WINDOW;
+}
+
+void RenoController::onAck(int nacked, double rtt_ms) {
+    (void)rtt_ms;
+    for (int i = 0; i < nacked; i++) {
+        if (m_cwnd < m_ssthresh)
+            m_cwnd += 1;  // slow start, doubles every round trip
+        else
+            m_cwnd += 1 / m_cwnd;  // congestion avoidance, +1 per round trip
+    }
+    m_cwnd = clampWindow(m_cwnd);
+}
+
+void RenoController::onLoss() {
+    m_ssthresh = clampWindow(m_cwnd / 2);
+    m_cwnd = m_ssthresh;
+}
+
+void RenoController::onTimeout() {
+    m_ssthresh = clampWindow(m_cwnd / 2);
+    m_cwnd = MIN_SEND_WINDOW;
+}
+
+int RenoController::window() const { return (int)m_cwnd; }
+
+/*
+ * Delay based
+ */
+
+DelayController::DelayController() {
+    m_cwnd = INITIAL_SEND_WINDOW;
+    m_ssthresh = MAX_SEND_WINDOW;
+    m_baseRtt = -1;
+}
+
+void DelayController::onAck(int nacked, double rtt_ms) {
+    if (rtt_ms > 0 && (m_baseRtt < 0 || rtt_ms < m_baseRtt))
+        m_baseRtt = rtt_ms;
+
+    // Without a measurement we can't judge queueing, behave like Reno
+    if (rtt_ms <= 0 || m_baseRtt <= 0) {
+        for (int i = 0; i < nacked; i++)
+            m_cwnd += (m_cwnd < m_ssthresh) ? 1 : 1 / m_cwnd;
+        m_cwnd = clampWindow(m_cwnd);
+        return;
+    }
+
+    // expected - actual throughput, scaled to messages sitting in queues
+    double queued = m_cwnd * (1 - m_baseRtt / rtt_ms);
+
+    for (int i = 0; i < nacked; i++) {
+        if (m_cwnd < m_ssthresh) {
+            // leave slow start as soon as queues start building
+            if (queued > VEGAS_ALPHA)
+                m_ssthresh = m_cwnd;
+            else
+                m_cwnd += 1;
+        } else if (queued < VEGAS_ALPHA) {
+            m_cwnd += 1 / m_cwnd;
+        } else if (queued > VEGAS_BETA) {
+            m_cwnd -= 1 / m_cwnd;
+        }
+    }
+    m_cwnd = clampWindow(m_cwnd);
+}
+
+void DelayController::onLoss() {
+    m_ssthresh = clampWindow(m_cwnd / 2);
+    m_cwnd = m_ssthresh;
+}
+
+void DelayController::onTimeout() {
+    m_ssthresh = clampWindow(m_cwnd / 2);
+    m_cwnd = MIN_SEND_WINDOW;
+}
+
+int DelayController::window() const { return (int)m_cwnd; }
+
+CongestionController *makeCongestionController(string name) {
+    if (name == "reno") return new RenoController();
+    if (name == "delay") return new DelayController();
+    return nullptr;
+}
@@ -0,0 +1,73 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include <string>
+
+#include "settings.h"
+
+// Decides how many messages the messenger may have in flight.
+//
+// The messenger reports every ACK and every loss event, the controller
+// answers with a window. Loss events are reported at most once per window
+// of data (the messenger ignores further losses from packets that were
+// already in flight when the window was last cut).
+class CongestionController {
+   public:
+    virtual ~CongestionController() {}
+
+    // nacked messages were ACK'd, rtt_ms is a fresh round trip sample or
+    // negative if there wasn't one (e.g. the message had been resent)
+    virtual void onAck(int nacked, double rtt_ms) = 0;
+
+    // a message was found missing while others kept getting through
+    virtual void onLoss() = 0;
+
+    // a retransmission timer fired, i.e. nothing is getting through
+    virtual void onTimeout() = 0;
+
+    // current congestion window, in messages
+    virtual int window() const = 0;
+
+    virtual const char *name() const = 0;
+};
+
+// Slow start followed by additive increase / multiplicative decrease,
+// like TCP Reno
+class RenoController : public CongestionController {
+   public:
+    RenoController();
+    void onAck(int nacked, double rtt_ms);
+    void onLoss();
+    void onTimeout();
+    int window() const;
+    const char *name() const { return "reno"; }
+
+   private:
+    double m_cwnd;
+    double m_ssthresh;
+};
+
+// Delay based, like TCP Vegas. Compares the RTT we see against the lowest
+// RTT ever seen to estimate how many of our messages are sitting in queues,
+// and keeps that number between VEGAS_ALPHA and VEGAS_BETA. Backs off before
+// the queues overflow instead of after.
+class DelayController : public CongestionController {
+   public:
+    DelayController();
+    void onAck(int nacked, double rtt_ms);
+    void onLoss();
+    void onTimeout();
+    int window() const;
+    const char *name() const { return "delay"; }
+
+   private:
+    double m_cwnd;
+    double m_ssthresh;
+    double m_baseRtt;  // lowest RTT seen, i.e. with empty queues
+};
+
+// Returns a new controller for the given name ("reno" or "delay"),
+// or nullptr if there is no such controller
+CongestionController *makeCongestionController(std::string name);
+
+#endif
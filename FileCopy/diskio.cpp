@@ -1,6 +1,7 @@
 #include "diskio.h"
 
 #include "c150debug.h"
+#include "checksumvote.h"
 #include "settings.h"
 
 #ifndef MAX_DISK_RETRIES
@@ -8,10 +9,13 @@
 #endif
 
 #include <dirent.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
@@ -38,8 +42,13 @@ bool bufferToFileNaive(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
 int fileToBufferSecure(NASTYFILE *nfp, string srcfile, uint8_t **buffer_pp,
                        unsigned char checksum[SHA_LEN]);
 // these have an end to end check
-bool bufferToFileSecure(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
-                        uint32_t bufferlen);
+WriteReceipt bufferToFileSecure(NASTYFILE *nfp, string srcfile,
+                                uint8_t *buffer, uint32_t bufferlen);
+
+// Reads back ranges that were just written to fname and writes again the
+// ones that didn't come back right, up to MAX_DISK_RETRIES times
+static bool rewriteUntilRight(NASTYFILE *nfp, string fname,
+                              vector<const FileRange *> todo, int *rewrites);
 
 /*
  * Overloading wrappers
@@ -51,103 +60,129 @@ bool bufferToFileSecure(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
 int fileToBuffer(NASTYFILE *nfp, string srcfile, uint8_t **buffer_pp,
                  unsigned char checksum[SHA_LEN]) {
     if (!isFile(srcfile)) {
-        fprintf(stderr, "%s is not a file", srcfile.c_str());
+        fprintf(stderr, "%s is not a file\n", srcfile.c_str());
         return -1;
     }
     return fileToBufferSecure(nfp, srcfile, buffer_pp, checksum);
 }
 
-// returns -1 in disk error
-// guarantees that data writted to disk is correct by trying repeatedly and
-// matching hashcodes
-bool bufferToFile(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
-                  uint32_t bufferlen) {
+// guarantees that data writted to disk is correct by reading it back a
+// block at a time and writing again the blocks that came back wrong
+WriteReceipt bufferToFile(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
+                          uint32_t bufferlen) {
     if (!isFile(srcfile)) {
-        fprintf(stderr, "%s is not a file", srcfile.c_str());
-        return -1;
+        fprintf(stderr, "%s is not a file\n", srcfile.c_str());
+        return WriteReceipt{};
     }
     return bufferToFileSecure(nfp, srcfile, buffer, bufferlen);
 }
 
-// Brute force secure read
-// needs to have 2 flawless of MAX_DISK_RETRIES reads
+// Reads the first size bytes of the file open in nfp a VOTE_BLOCK at a
+// time. Each block is read again, with fseek and fread, until one checksum
+// for it wins the vote (see ChecksumVote), and the winning copy goes to
+// onBlock(offset, data, len) in file order. A bad read only spoils a sample
+// of its own block, so the reads a file takes grow with how much of it
+// comes back wrong rather than with its size. Returns false if some block
+// couldn't be read at all.
+template <typename F>
+static bool readBlocksSecure(NASTYFILE *nfp, string srcfile, long size,
+                             F onBlock) {
+    vector<uint8_t> block(VOTE_BLOCK), best(VOTE_BLOCK);
+    long reads = 0, nblocks = 0, disagreed = 0;
+    for (long offset = 0; offset < size; offset += VOTE_BLOCK, nblocks++) {
+        size_t want = min((long)VOTE_BLOCK, size - offset);
+        ChecksumVote vote;
+        for (int i = 0; i < HASH_SAMPLES && !vote.decided(); i++) {
+            nfp->fseek(offset, SEEK_SET);
+            if (nfp->fread(block.data(), 1, want) != want) continue;
+            checksum_t checksum;
+            SHA1(block.data(), want, checksum);
+            if (vote.add(checksum)) best.swap(block);
+        }
+        if (vote.reads() == 0) {
+            cerr << "Error reading input file " << srcfile << endl;
+            return false;
+        }
+        reads += vote.reads();
+        disagreed += vote.disagreed();
+        onBlock(offset, best.data(), want);
+    }
+
+    // only worth a mention if some reads came back wrong
+    if (disagreed > 0)
+        c150debug->printf(C150APPLICATION,
+                          "took %ld reads of %ld blocks of %s to agree, %ld "
+                          "of them bad\n",
+                          reads, nblocks, srcfile.c_str(), disagreed);
+    return true;
+}
+
+// Same vote as fileToBufferSecure, but only the winning copy of one block is
+// kept at a time
+long fileChecksum(NASTYFILE *nfp, string srcfile,
+                  unsigned char checksumOut[SHA_LEN]) {
+    if (!isFile(srcfile)) {
+        fprintf(stderr, "%s is not a file\n", srcfile.c_str());
+        return -1;
+    }
+    struct stat statbuf;
+    if (lstat(srcfile.c_str(), &statbuf) != 0) return -1;
+    if (nfp->fopen(srcfile.c_str(), "rb") == NULL) {
+        cerr << "Error opening input file " << srcfile << endl;
+        return -1;
+    }
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+    long size = statbuf.st_size;
+    if (!readBlocksSecure(nfp, srcfile, size,
+                          [&](long, const uint8_t *data, size_t len) {
+                              EVP_DigestUpdate(ctx, data, len);
+                          }))
+        size = -1;
+    EVP_DigestFinal_ex(ctx, checksumOut, NULL);
+    EVP_MD_CTX_free(ctx);
+    nfp->fclose();
+    return size;
+}
+
+// Secure read, voting a block at a time (see readBlocksSecure)
 int fileToBufferSecure(NASTYFILE *nfp, string srcfile, uint8_t **buffer_pp,
                        unsigned char checksumOut[SHA_LEN]) {
     assert((buffer_pp == nullptr || *buffer_pp == nullptr) && checksumOut);
 
-    int high_count = 0;
-    uint8_t *high_buffer = nullptr;
-    checksum_t high_checksum;
-    int high_buflen = 0;
-    unordered_map<string, int> checksums;
-    for (int i = 0; i < HASH_SAMPLES; i++) {
-        uint8_t *buffer = nullptr;
-        checksum_t checksum;
-
-        int buflen = fileToBufferNaive(nfp, srcfile, &buffer);
-        assert(buffer);
-        if (buflen == -1) return -1;
-        SHA1(buffer, buflen, checksum);
-
-        string checksumStr((char *)checksum, SHA_LEN);
-        if (checksums.count(checksumStr)) {
-            checksums[checksumStr]++;
-        } else {
-            checksums[checksumStr] = 1;
-        }
+    struct stat statbuf;
+    if (lstat(srcfile.c_str(), &statbuf) != 0) {  // maybe file doesn't exist
+        fprintf(stderr, "copyFile: Error stating supplied source file %s\n",
+                srcfile.c_str());
+        return -1;
+    }
+    if (nfp->fopen(srcfile.c_str(), "rb") == NULL) {
+        cerr << "Error opening input file " << srcfile << endl;
+        return -1;
+    }
 
-        if (checksums[checksumStr] > high_count) {
-            high_count = checksums[checksumStr];
-            if (high_buffer) free(high_buffer);
-            high_buffer = buffer;
-            memcpy(high_checksum, checksum, SHA_LEN);
-            high_buflen = buflen;
-        } else {
-            free(buffer);
-        }
+    int buflen = statbuf.st_size;
+    uint8_t *buffer = (uint8_t *)malloc(max(buflen, 1));
+    assert(buffer);
+    bool ok = readBlocksSecure(nfp, srcfile, buflen,
+                               [&](long offset, const uint8_t *data,
+                                   size_t len) {
+                                   memcpy(buffer + offset, data, len);
+                               });
+    nfp->fclose();
+    if (!ok) {
+        free(buffer);
+        return -1;
     }
 
+    SHA1(buffer, buflen, checksumOut);
     if (buffer_pp) {
-        *buffer_pp = high_buffer;
+        *buffer_pp = buffer;
     } else {
-        free(high_buffer);
+        free(buffer);
     }
-    if (checksumOut) memcpy(checksumOut, high_checksum, SHA_LEN);
-    return high_buflen;
-
-    // unsigned char checksums[MAX_DISK_RETRIES][SHA_LEN] = {0};
-    // for (int i = 0; i < MAX_DISK_RETRIES; i++) {  // for each try
-    //     uint8_t *buffer = nullptr;
-    //     int buflen = fileToBufferNaive(nfp, srcfile, &buffer);
-    //     assert(buffer);
-    //     if (buflen == -1) return -1;
-
-    //     SHA1(buffer, buflen, checksums[i]);
-    //     int matching = 0;
-    //     for (int j = 0; j < i; j++) {  // for each past checksum
-    //         if (memcmp(checksums[j], checksums[i], SHA_LEN) == 0) {
-    //             matching++;
-    //         }
-    //         // Require HASH_MATCHES matches to be sure
-    //         if (matching >= HASH_MATCHES) {
-    //             if (buffer_pp) *buffer_pp = buffer;
-    //             if (checksumOut) memcpy(checksumOut, checksums[i],
-    //             SHA_LEN); return buflen;
-    //         }
-    //     }
-
-    //     if (i > 1)
-    //         c150debug->printf(C150APPLICATION,
-    //                           "failed read of %s for %ith time\n",
-    //                           srcfile.c_str(), i);
-
-    //     free(buffer);  // bad buffer
-    // }
-
-    fprintf(stderr,
-            "Disk failure -- unable to reliably open file %s in %d attempts\n",
-            srcfile.c_str(), MAX_DISK_RETRIES);
-    return -1;
+    return buflen;
 }
 
 // Read whole input file (mostly taken from Noah's samples)
@@ -186,33 +221,36 @@ int fileToBufferNaive(NASTYFILE *nfp, string srcfile, uint8_t **buffer_pp) {
     return len;
 }
 
-// Brute force secure write (with a read sanity check)
-// in terms of luck, it only needs a single perfect write
-bool bufferToFileSecure(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
-                        uint32_t bufferlen) {
-    unsigned char bufferChecksum[SHA_LEN];
-    unsigned char diskChecksum[SHA_LEN];
-    SHA1(buffer, bufferlen, bufferChecksum);
-
-    for (int i = 0; i < MAX_DISK_RETRIES; i++) {  // for each try
-        // write to buffer to disk
-        bufferToFileNaive(nfp, srcfile, buffer, bufferlen);
-
-        // read back from the disk
-        uint8_t *diskbuf = nullptr;
-        fileToBufferSecure(nfp, srcfile, &diskbuf, diskChecksum);
-        free(diskbuf);
-        if (memcmp(bufferChecksum, diskChecksum, SHA_LEN) == 0) return true;
-
-        c150debug->printf(C150APPLICATION,
-                          "failed write of %d bytes in %s for %ith time\n",
-                          bufferlen, srcfile.c_str(), i);
+// Secure write: the whole buffer once, then only the VOTE_BLOCK blocks of
+// it that don't read back right
+WriteReceipt bufferToFileSecure(NASTYFILE *nfp, string srcfile,
+                                uint8_t *buffer, uint32_t bufferlen) {
+    WriteReceipt receipt{};
+    receipt.size = bufferlen;
+    SHA1(buffer, bufferlen, receipt.checksum);
+
+    if (nfp->fopen(srcfile.c_str(), "wb") == NULL) {
+        cerr << "Error opening output file " << srcfile << endl;
+        return receipt;
     }
-
-    fprintf(stderr,
-            "Disk failure -- unable to reliably open file %s in %d attempts\n",
-            srcfile.c_str(), MAX_DISK_RETRIES);
-    return -1;
+    nfp->fwrite(buffer, 1, bufferlen);
+    nfp->fclose();
+
+    vector<FileRange> blocks;
+    for (uint32_t offset = 0; offset < bufferlen; offset += VOTE_BLOCK)
+        blocks.push_back({(long)offset, buffer + offset,
+                          min((uint32_t)VOTE_BLOCK, bufferlen - offset)});
+    vector<const FileRange *> todo;
+    for (const FileRange &b : blocks) todo.push_back(&b);
+    receipt.ok = rewriteUntilRight(nfp, srcfile, todo, &receipt.rewrites) &&
+                 stampFile(srcfile, &receipt.stamp);
+
+    if (!receipt.ok)
+        fprintf(stderr,
+                "Disk failure -- unable to reliably write file %s in %d "
+                "attempts\n",
+                srcfile.c_str(), MAX_DISK_RETRIES);
+    return receipt;
 }
 
 bool bufferToFileNaive(NASTYFILE *nfp, string srcfile, uint8_t *buffer,
@@ -248,6 +286,75 @@ void touch(NASTYFILE *nfp, string fname) {
     }
 }
 
+bool setFileSize(string fname, long size) {
+    if (truncate(fname.c_str(), size) != 0) {
+        cerr << "Error resizing file " << fname << endl;
+        return false;
+    }
+    return true;
+}
+
+bool stampFile(string fname, FileStamp *stamp) {
+    struct stat statbuf;
+    if (lstat(fname.c_str(), &statbuf) != 0) return false;
+    stamp->size = statbuf.st_size;
+    stamp->inode = statbuf.st_ino;
+    stamp->mtime = statbuf.st_mtim;
+    return true;
+}
+
+bool writeRanges(NASTYFILE *nfp, string fname,
+                 const vector<FileRange> &ranges) {
+    if (nfp->fopen(fname.c_str(), "r+b") == NULL) return false;
+    vector<const FileRange *> todo;
+    for (const FileRange &r : ranges) {
+        nfp->fseek(r.offset, SEEK_SET);
+        nfp->fwrite(r.data, 1, r.len);
+        todo.push_back(&r);
+    }
+    nfp->fclose();
+    int rewrites;
+    return rewriteUntilRight(nfp, fname, todo, &rewrites);
+}
+
+static bool rewriteUntilRight(NASTYFILE *nfp, string fname,
+                              vector<const FileRange *> todo, int *rewrites) {
+    *rewrites = 0;
+    vector<uint8_t> readback;
+    for (int i = 0; !todo.empty(); i++) {
+        // Only what made it to disk counts, so read it back after closing.
+        // A bad read just costs a needless rewrite.
+        if (nfp->fopen(fname.c_str(), "rb") == NULL) return false;
+        vector<const FileRange *> bad;
+        for (const FileRange *r : todo) {
+            readback.resize(r->len);
+            nfp->fseek(r->offset, SEEK_SET);
+            if (nfp->fread(readback.data(), 1, r->len) != r->len ||
+                memcmp(readback.data(), r->data, r->len) != 0)
+                bad.push_back(r);
+        }
+        nfp->fclose();
+        if (bad.empty() || i == MAX_DISK_RETRIES) {
+            todo.swap(bad);
+            break;
+        }
+
+        c150debug->printf(C150APPLICATION,
+                          "%d of %d ranges of %s came back wrong, "
+                          "writing them again\n",
+                          bad.size(), todo.size(), fname.c_str());
+        todo.swap(bad);
+        if (nfp->fopen(fname.c_str(), "r+b") == NULL) return false;
+        for (const FileRange *r : todo) {
+            nfp->fseek(r->offset, SEEK_SET);
+            nfp->fwrite(r->data, 1, r->len);
+        }
+        nfp->fclose();
+        *rewrites += todo.size();
+    }
+    return todo.empty();
+}
+
 //
 //
 // Utilities
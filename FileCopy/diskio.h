@@ -2,8 +2,11 @@
 #define DISKIO_H
 
 #include <openssl/sha.h>
+#include <sys/types.h>
 
+#include <ctime>
 #include <string>
+#include <vector>
 
 #include "c150nastyfile.h"
 #include "settings.h"
@@ -17,13 +20,63 @@ int fileToBuffer(C150NETWORK::C150NastyFile *nfp, string srcfile,
                  uint8_t **buffer_pp,
                  unsigned char checksum[SHA_DIGEST_LENGTH]);
 
-bool bufferToFile(C150NETWORK::NASTYFILE *nfp, string srcfile, uint8_t *buffer,
-                  uint32_t bufferlen);
+// Enough of a file's metadata to tell whether it was touched since
+struct FileStamp {
+    long size = -1;
+    ino_t inode = 0;
+    struct timespec mtime = {0, 0};
+
+    bool operator==(const FileStamp &other) const {
+        return size == other.size && inode == other.inode &&
+               mtime.tv_sec == other.mtime.tv_sec &&
+               mtime.tv_nsec == other.mtime.tv_nsec;
+    }
+};
+
+// Fills stamp for fname, false if it can't be stat'd
+bool stampFile(string fname, FileStamp *stamp);
+
+// What a verified write put on disk
+struct WriteReceipt {
+    bool ok;              // every block read back right
+    long size;            // bytes written
+    checksum_t checksum;  // SHA1 of them
+    int rewrites;         // blocks that had to be written again
+    FileStamp stamp;      // of the file once they were all right
+};
+
+// writes buffer over srcfile, which must exist, then reads it back a
+// VOTE_BLOCK at a time, writing again only the blocks that came back wrong
+WriteReceipt bufferToFile(C150NETWORK::NASTYFILE *nfp, string srcfile,
+                          uint8_t *buffer, uint32_t bufferlen);
+
+// like fileToBuffer, but only computes the checksum, keeping one VOTE_BLOCK
+// at a time so memory doesn't grow with the file
+// returns length of file or -1 if failed
+long fileChecksum(C150NETWORK::NASTYFILE *nfp, string srcfile,
+                  unsigned char checksum[SHA_DIGEST_LENGTH]);
 
 // Creates an empty file with the given filename
 // If the file already exists, it is truncated
 void touch(C150NETWORK::NASTYFILE *nfp, string fname);
 
+// Sets the size of an existing file, zero filling or truncating it
+bool setFileSize(string fname, long size);
+
+// A piece of a file, at offset
+struct FileRange {
+    long offset;
+    const uint8_t *data;
+    uint32_t len;
+};
+
+// Writes every range at its offset in fname, which must exist. Reads them
+// back and writes again the ones that didn't come back right, up to
+// MAX_DISK_RETRIES times. Returns false if fname can't be opened or some
+// range never came back right.
+bool writeRanges(C150NETWORK::NASTYFILE *nfp, string fname,
+                 const std::vector<FileRange> &ranges);
+
 // // all guaranteed safe
 // int filesize(char *fname);
 // int filechecksum(C150NETWORK::NASTYFILE *nfp, char *fname, checksum_t
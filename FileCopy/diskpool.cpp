@@ -0,0 +1,92 @@
+#include "diskpool.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+
+#include "c150debug.h"
+#include "c150network.h"
+
+using namespace C150NETWORK;
+using namespace std;
+
+static int makeEventFd(int flags) {
+    int fd = eventfd(0, EFD_CLOEXEC | flags);
+    if (fd < 0)
+        throw C150NetworkException(string("DiskPool: eventfd: ") +
+                                   strerror(errno));
+    return fd;
+}
+
+static void notify(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+DiskPool::DiskPool(int nworkers, int nastiness) {
+    m_stopping = false;
+    m_doneFd = makeEventFd(EFD_NONBLOCK);
+    for (int i = 0; i < nworkers; i++) {
+        Worker *w = new Worker();
+        w->wakeFd = makeEventFd(0);
+        w->nfp = new C150NastyFile(nastiness);
+        m_workers.push_back(w);
+    }
+    // only once every worker is in place
+    for (Worker *w : m_workers) w->thread = thread(&DiskPool::work, this, w);
+    c150debug->printf(C150APPLICATION, "Started %d disk workers\n", nworkers);
+}
+
+DiskPool::~DiskPool() {
+    m_stopping = true;
+    for (Worker *w : m_workers) {
+        notify(w->wakeFd);
+        w->thread.join();
+        close(w->wakeFd);
+        delete w->nfp;
+        delete w;
+    }
+    close(m_doneFd);
+}
+
+void DiskPool::submit(size_t key, function<void(C150NastyFile *)> run,
+                      function<void()> done) {
+    Job *job = new Job();
+    job->run = run;
+    job->done = done;
+    Worker *w = m_workers[key % m_workers.size()];
+    // a full queue means the disk is far behind, wait for it
+    while (!w->jobs.push(job)) this_thread::yield();
+    notify(w->wakeFd);
+}
+
+void DiskPool::reap() {
+    uint64_t count;
+    while (read(m_doneFd, &count, sizeof(count)) < 0 && errno == EINTR)
+        ;
+    // Jobs pushed after this still signal, so none get stranded
+    for (Job *job = m_done.pop(); job; job = m_done.pop()) {
+        job->done();
+        delete job;
+    }
+}
+
+void DiskPool::work(Worker *w) {
+    while (true) {
+        // Sleep until something is pushed, then take all of it
+        uint64_t count;
+        if (read(w->wakeFd, &count, sizeof(count)) < 0 && errno != EINTR)
+            break;
+        if (m_stopping) break;
+        Job *job;
+        while (w->jobs.pop(job)) {
+            job->run(w->nfp);
+            m_done.push(job);
+            notify(m_doneFd);
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef DISKPOOL_H
+#define DISKPOOL_H
+
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
+#include "c150nastyfile.h"
+#include "queues.h"
+#include "settings.h"
+
+// Disk workers for a server thread.
+//
+// Writing and verifying a file through a nasty file handler takes many
+// reads and writes, far too long to do on the thread that reads the socket.
+// That thread submits jobs instead. Each worker has its own nasty file
+// handler and a lock-free queue the submitting thread feeds, and finished
+// jobs come back over one lock-free queue, signalled through an eventfd
+// the submitting thread's event loop watches.
+class DiskPool {
+   public:
+    // Starts nworkers workers, each with a C150NastyFile of nastiness
+    DiskPool(int nworkers, int nastiness);
+    ~DiskPool();
+
+    // Runs run on a worker, and later done on the thread that calls
+    // reap(). Jobs with the same key run on the same worker, in order, so
+    // jobs about one file never race.
+    void submit(size_t key, std::function<void(C150NETWORK::C150NastyFile *)> run,
+                std::function<void()> done);
+
+    // Readable when some job is done, for the event loop
+    int completionFd() const { return m_doneFd; }
+
+    // Calls done for every finished job. Only from the submitting thread.
+    void reap();
+
+   private:
+    struct Job {
+        std::function<void(C150NETWORK::C150NastyFile *)> run;
+        std::function<void()> done;
+        std::atomic<Job *> next;  // for MpscQueue
+    };
+
+    struct Worker {
+        SpscQueue<Job *, DISK_QUEUE_SIZE> jobs;
+        int wakeFd;  // eventfd, counts jobs pushed
+        C150NETWORK::C150NastyFile *nfp;
+        std::thread thread;
+    };
+
+    void work(Worker *w);
+
+    std::vector<Worker *> m_workers;
+    MpscQueue<Job> m_done;
+    int m_doneFd;
+    std::atomic<bool> m_stopping;
+};
+
+#endif
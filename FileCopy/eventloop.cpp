@@ -0,0 +1,97 @@
+#include "eventloop.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "c150network.h"
+
+using namespace C150NETWORK;
+using namespace std;
+
+// Most file descriptor events handled per epoll_wait
+#define MAX_EVENTS 16
+
+EventLoop::EventLoop() {
+    m_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epfd < 0)
+        throw C150NetworkException(string("EventLoop: epoll_create1: ") +
+                                   strerror(errno));
+    m_stopped = false;
+}
+
+EventLoop::~EventLoop() { close(m_epfd); }
+
+void EventLoop::watch(int fd, Callback onReadable) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    int op = m_watched.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(m_epfd, op, fd, &ev) < 0)
+        throw C150NetworkException(string("EventLoop: epoll_ctl: ") +
+                                   strerror(errno));
+    m_watched[fd] = onReadable;
+}
+
+void EventLoop::unwatch(int fd) {
+    if (!m_watched.count(fd)) return;
+    epoll_ctl(m_epfd, EPOLL_CTL_DEL, fd, nullptr);
+    m_watched.erase(fd);
+}
+
+EventLoop::TimerId EventLoop::at(clock::time_point when, Callback cb) {
+    return m_timers.add(when, cb);
+}
+
+void EventLoop::cancel(TimerId id) { m_timers.cancel(id); }
+
+int EventLoop::runOnce(int max_wait_ms) {
+    // Sleep no longer than until the next timer is due
+    int wait_ms = max_wait_ms;
+    if (m_timers.pending() > 0) {
+        auto until = m_timers.nextDue() - clock::now();
+        // round up, waking early would only spin
+        int timer_ms = chrono::duration_cast<chrono::milliseconds>(
+                           until + chrono::microseconds(999))
+                           .count();
+        if (timer_ms < 0) timer_ms = 0;
+        if (wait_ms < 0 || timer_ms < wait_ms) wait_ms = timer_ms;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int nready = epoll_wait(m_epfd, events, MAX_EVENTS, wait_ms);
+    if (nready < 0 && errno != EINTR)
+        throw C150NetworkException(string("EventLoop: epoll_wait: ") +
+                                   strerror(errno));
+
+    int handled = 0;
+    for (int i = 0; i < nready; i++) {
+        auto it = m_watched.find(events[i].data.fd);
+        if (it == m_watched.end()) continue;  // unwatched by an earlier one
+        Callback cb = it->second;             // may unwatch itself
+        cb();
+        handled++;
+    }
+
+    // Fire every timer that's due. Callbacks may add or cancel timers, so
+    // take them one at a time.
+    m_due.clear();
+    m_timers.advance(clock::now(), m_due);
+    for (TimerId id : m_due) {
+        Callback cb;
+        if (!m_timers.take(id, cb)) continue;  // cancelled by an earlier one
+        cb();
+        handled++;
+    }
+    return handled;
+}
+
+void EventLoop::run() {
+    m_stopped = false;
+    while (!m_stopped) runOnce();
+}
@@ -0,0 +1,57 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "timerwheel.h"
+
+// Single threaded event loop on epoll.
+//
+// Calls back when watched file descriptors become readable and when timers
+// come due, so one thread can wait on sockets, retransmit deadlines and
+// anything else with a file descriptor (e.g. an eventfd signalled by a disk
+// worker) at the same time, instead of blocking on each in turn.
+class EventLoop {
+   public:
+    typedef std::chrono::steady_clock clock;
+    typedef TimerWheel::Callback Callback;
+    typedef TimerWheel::TimerId TimerId;
+
+    EventLoop();
+    ~EventLoop();
+
+    // Calls onReadable every time the loop finds fd readable (level
+    // triggered, so it fires again until fd is drained)
+    void watch(int fd, Callback onReadable);
+    void unwatch(int fd);
+
+    // Calls cb once, at the first loop iteration after when. Returns an id
+    // for cancel(), never 0. Both are O(1), see timerwheel.h.
+    TimerId at(clock::time_point when, Callback cb);
+
+    // Forgets a timer. Harmless if it already fired or was cancelled.
+    void cancel(TimerId id);
+
+    // Waits until something happens, but no longer than max_wait_ms (-1
+    // for as long as it takes, or until the next timer), and handles it.
+    // Returns the number of callbacks made.
+    int runOnce(int max_wait_ms = -1);
+
+    // Runs until stop() is called from a callback
+    void run();
+    void stop() { m_stopped = true; }
+
+   private:
+    int m_epfd;
+    bool m_stopped;
+    std::unordered_map<int, Callback> m_watched;
+
+    TimerWheel m_timers;
+    std::vector<TimerId> m_due;  // timers that came due this iteration
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "filecache.h"
 
+#include <array>
 #include <cstdio>
+#include <memory>
 
 #include "c150debug.h"
 #include "diskio.h"
@@ -12,6 +14,8 @@ using namespace std;
  *  STATUS   | SEQNO WAS LAST SET WHEN
  *  -------------------------------------------------------------------
  *  PARTIAL  | received a prepareForFile since last NON-PARTIAL
+ *  WRITING  | final section was received
+ *  CHECKING | last attempted to verify the file
  *  TMP      | final section was received
  *           OR
  *           | last attempted to verify the file
@@ -25,22 +29,55 @@ using namespace std;
 
 // small readability adjustment
 
-Filecache::Filecache(string dir, C150NastyFile *nfp) {
+Filecache::Filecache(string dir, C150NastyFile *nfp, DiskPool *disk) {
     m_dir = dir;
     m_nfp = nfp;
+    m_disk = disk;
+    m_diskJobs = 0;
+}
+
+bool Filecache::checkPending(int id, seq_t seqno, const string filename,
+                             const checksum_t checksum) {
+    if (!m_disk) return false;
+
+    auto it = m_cache.find(id);
+    if (it == m_cache.end()) {
+        // a pre-existing file, see idempotentCheckfile
+        cerr << "got filecheck for unknown id " << id << endl;
+        CacheEntry &entry = m_cache[id];
+        entry = {FileStatus::CHECKING, seqno, filename};
+        entry.existing = true;
+        submitCheck(id, makeFileName(m_dir, filename), checksum);
+        return true;
+    }
+
+    CacheEntry &entry = it->second;
+    switch (entry.status) {
+        case FileStatus::WRITING:  // checked once written, if asked again
+        case FileStatus::CHECKING:
+            return true;
+        case FileStatus::TMP:
+            if (seqno <= entry.seqno) return false;  // old, it gets an SOS
+            // answered without reading it, see idempotentCheckfile
+            if (writtenUnchanged(entry)) return false;
+            entry.seqno = seqno;
+            submitCheck(id, makeTmpFileName(m_dir, filename), checksum);
+            return true;
+        default:
+            return false;
+    }
 }
 
 // returns true if file is good
-bool Filecache::filecheck(string filename, const checksum_t checksum) {
-    uint8_t *buffer = nullptr;
+bool Filecache::filecheck(C150NastyFile *nfp, string filename,
+                          const checksum_t checksum) {
     uint8_t diskChecksum[SHA_DIGEST_LENGTH];
 
-    // fileToBuffer guarantees no nastyfile issues
-    int len = fileToBuffer(m_nfp, filename, &buffer, diskChecksum);
+    // fileChecksum guarantees no nastyfile issues
+    long len = fileChecksum(nfp, filename, diskChecksum);
 
     if (len == -1) return SOS;  // file doesn't exist
 
-    free(buffer);
     return (memcmp(diskChecksum, checksum, SHA_DIGEST_LENGTH)) ? SOS : ACK;
 }
 
@@ -51,14 +88,13 @@ bool Filecache::idempotentCheckfile(int id, seq_t seqno, const string filename,
     // anyway. This is kind of a hack that lets us verify pre-existing files.
     if (!m_cache.count(id)) {
         cerr << "got filecheck for unknown id " << id << endl;
-        vector<FileSegment> nosegments;
         // cache if success (note we check the actual file not .tmp)
-        if (filecheck(makeFileName(m_dir, filename), checksum)) {
-            m_cache[id] = {FileStatus::SAVED, seqno, filename, nosegments};
+        if (filecheck(m_nfp, makeFileName(m_dir, filename), checksum)) {
+            m_cache[id] = {FileStatus::SAVED, seqno, filename};
             return ACK;
         }
         // move to tmp file
-        m_cache[id] = {FileStatus::TMP, seqno, filename, nosegments};
+        m_cache[id] = {FileStatus::TMP, seqno, filename};
         rename(makeFileName(m_dir, filename).c_str(),
                makeTmpFileName(m_dir, filename).c_str());
         return SOS;
@@ -71,6 +107,11 @@ bool Filecache::idempotentCheckfile(int id, seq_t seqno, const string filename,
             cerr << "failed to check file " << filename
                  << " because it has not finished transferring" << endl;
             return SOS;
+        case FileStatus::WRITING:  // callers should wait, see checkPending()
+        case FileStatus::CHECKING:
+            cerr << "failed to check file " << filename
+                 << " because it is still being written or checked" << endl;
+            return SOS;
         case FileStatus::TMP:
             // We have already done the check, but it is still in TMP,
             // Instead, if it's an old message the client can figure it out
@@ -84,8 +125,13 @@ bool Filecache::idempotentCheckfile(int id, seq_t seqno, const string filename,
             // file was finished
             entry.seqno = seqno;
 
-            // check the .tmp file
-            if (!filecheck(makeTmpFileName(m_dir, filename), checksum)) {
+            // check the .tmp file, from what was written to it if that's
+            // still what it holds
+            if (writtenUnchanged(entry)
+                    ? memcmp(entry.written.checksum, checksum,
+                             SHA_DIGEST_LENGTH) != 0
+                    : !filecheck(m_nfp, makeTmpFileName(m_dir, filename),
+                                 checksum)) {
                 cerr << "failed to check file " << filename
                      << " because checksums didn't match" << endl;
                 return SOS;
@@ -97,7 +143,7 @@ bool Filecache::idempotentCheckfile(int id, seq_t seqno, const string filename,
     }
 }
 
-bool Filecache::idempotentSaveFile(int id, seq_t seqno) {
+bool Filecache::idempotentSaveFile(int id, seq_t /* seqno */) {
     if (!m_cache.count(id)) return SOS;
     CacheEntry &entry = m_cache[id];
     switch (entry.status) {
@@ -119,12 +165,17 @@ bool Filecache::idempotentDeleteTmp(int id, seq_t seqno) {
     CacheEntry &entry = m_cache[id];
     switch (entry.status) {
         case FileStatus::PARTIAL:
+        case FileStatus::WRITING:  // not checked yet, so an old message
+        case FileStatus::CHECKING:
             return ACK;
         case FileStatus::TMP:
-            remove(makeTmpFileName(m_dir, m_cache[id].filename).c_str());
+            // start over with an empty .tmp file
             entry.seqno = seqno;
             entry.deleteSections();
+            entry.parts.reset();
+            entry.size = -1;
             entry.status = FileStatus::PARTIAL;
+            startTemp(id);
             return ACK;
         case FileStatus::VERIFIED:
             return SOS;
@@ -134,9 +185,26 @@ bool Filecache::idempotentDeleteTmp(int id, seq_t seqno) {
     return ACK;
 }
 
+// True if a blob of nparts sections of secsize bytes is one a client could
+// send us: nparts and secsize come straight off the wire, and the .tmp file
+// and the arena are sized from them
+static bool sensibleBlob(uint32_t nparts, uint32_t secsize) {
+    if (secsize == 0 || secsize > sectionDataSize(MAX_DATAGRAM_SIZE))
+        return false;
+    // every section but the last is full
+    return nparts == 0 || (uint64_t)(nparts - 1) * secsize < MAX_BLOB_SIZE;
+}
+
 bool Filecache::idempotentPrepareForFile(int id, seq_t seqno,
                                          const string filename,
-                                         uint32_t nparts) {
+                                         uint32_t nparts, uint32_t secsize) {
+    if (!sensibleBlob(nparts, secsize)) {
+        c150debug->printf(C150APPLICATION,
+                          "refusing file %s, id %d: %u parts of %u bytes\n",
+                          filename.c_str(), id, nparts, secsize);
+        return SOS;
+    }
+
     // Make a new empty registry for the file in the cache
     // The case we want to do this for is that either
     // 1. It doesn't already exist
@@ -149,15 +217,47 @@ bool Filecache::idempotentPrepareForFile(int id, seq_t seqno,
         // free any old date in the event this is a retransmission
         m_cache[id].deleteSections();
         // Build a new file cache entry
-        vector<FileSegment> sections(nparts);
-        CacheEntry entry = {FileStatus::PARTIAL, seqno, filename, sections};
+        CacheEntry entry = {FileStatus::PARTIAL, seqno, filename, secsize};
+        entry.parts = Reassembly(nparts);
+        entry.deleteSections();  // for the arena
         m_cache[id] = entry;
+        startTemp(id);
     }
     return ACK;
 }
 
+bool Filecache::idempotentResumeFile(int id, seq_t seqno,
+                                     const string filename, uint32_t nparts,
+                                     uint32_t secsize,
+                                     vector<PartRange> &missing) {
+    missing.clear();
+    if (!sensibleBlob(nparts, secsize))
+        return idempotentPrepareForFile(id, seqno, filename, nparts, secsize);
+    bool known = m_cache.count(id) && m_cache[id].filename == filename;
+    if (!known || (m_cache[id].status == FileStatus::PARTIAL &&
+                   (m_cache[id].parts.size() != nparts ||
+                    m_cache[id].secsize != secsize))) {
+        // nothing worth keeping, start over
+        if (m_cache.count(id)) m_cache[id].deleteSections();
+        m_cache.erase(id);
+        idempotentPrepareForFile(id, seqno, filename, nparts, secsize);
+    }
+
+    // TMP and later already have every section
+    CacheEntry &entry = m_cache[id];
+    if (entry.status != FileStatus::PARTIAL) return ACK;
+    // one more than fits tells intoMissingParts to round up
+    entry.parts.missing(missing, MAX_MISSING_RANGES + 1);
+    c150debug->printf(C150APPLICATION,
+                      "resuming file %s, id %d, %d ranges missing.\n",
+                      filename.c_str(), id, missing.size());
+    return ACK;
+}
+
 bool Filecache::idempotentStoreFileChunk(int id, seq_t seqno, uint32_t partno,
-                                         uint8_t *data, uint32_t len) {
+                                         uint8_t *data, uint32_t len,
+                                         seq_t *recovered) {
+    *recovered = -1;
     if (!m_cache.count(id)) return SOS;
 
     CacheEntry &entry = m_cache[id];
@@ -168,60 +268,339 @@ bool Filecache::idempotentStoreFileChunk(int id, seq_t seqno, uint32_t partno,
             partno, id);
         // add fresh section, if seqno is more recent than when file was first
         // announced
-        if (entry.seqno < seqno && entry.sections[partno].data == nullptr) {
-            entry.sections[partno].len = len;
-            entry.sections[partno].data = (uint8_t *)malloc(len);
-            memcpy(entry.sections[partno].data, data, len);
+        if (entry.seqno < seqno && !entry.parts.has(partno)) {
+            // every section but the last is exactly secsize
+            uint32_t nparts = entry.parts.size();
+            if (partno >= nparts || len > entry.secsize ||
+                (partno < nparts - 1 && len != entry.secsize)) {
+                cerr << "section " << partno << " of " << len
+                     << " bytes doesn't fit file " << entry.filename << endl;
+                return SOS;
+            }
+            FileSegment section;
+            section.len = len;
+            section.data = entry.arena->alloc();
+            memcpy(section.data, data, len);
+            stageSection(entry, partno, section);
+
+            // a parity may be waiting on this section
+            auto it = entry.parities.upper_bound(partno);
+            if (it != entry.parities.begin()) {
+                --it;
+                if (partno < it->first + it->second.count)
+                    *recovered = recoverSection(entry, it->first);
+            }
         }
 
-        // if any sections are still null, we are still partial
-        for (auto &section : entry.sections)
-            if (section.data == nullptr) return ACK;
+        flushStaged(id);
+        finishIfComplete(id, seqno);
+    }
+    return ACK;
+}
+
+bool Filecache::idempotentStoreParity(int id, seq_t seqno,
+                                      const BlobParity *parity, uint32_t len,
+                                      seq_t *recovered) {
+    *recovered = -1;
+    if (!m_cache.count(id)) return SOS;
 
-        // if no sections are null, move to TMP
-        partialToTemp(id);
-        entry.seqno = seqno;  // for TMP entries, seqno is the most recent
-                              // filecheck or when file was finished
+    CacheEntry &entry = m_cache[id];
+    if (entry.status == FileStatus::PARTIAL && entry.seqno < seqno &&
+        parity->first + parity->count <= entry.parts.size() &&
+        len <= entry.secsize && !entry.parities.count(parity->first)) {
+        GroupParity &p = entry.parities[parity->first];
+        p.seqno = seqno;
+        p.count = parity->count;
+        p.lenxor = parity->lenxor;
+        p.xordata.len = len;
+        p.xordata.data = entry.arena->alloc();
+        memcpy(p.xordata.data, parity->data, len);
+
+        *recovered = recoverSection(entry, parity->first);
+        flushStaged(id);
+        finishIfComplete(id, seqno);
     }
     return ACK;
 }
 
-uint32_t Filecache::joinBuffers(vector<FileSegment> fs, uint8_t **buffer_pp) {
-    uint32_t sumlen = 0;
-    for (auto s : fs) sumlen += s.len;
+void Filecache::stageSection(CacheEntry &entry, uint32_t partno,
+                             FileSegment section) {
+    entry.staged[partno] = section;
+    entry.stagedBytes += section.len;
+    entry.parts.mark(partno);
+    if (partno == entry.parts.size() - 1)
+        entry.size = (long)partno * entry.secsize + section.len;
+}
+
+seq_t Filecache::recoverSection(CacheEntry &entry, uint32_t first) {
+    GroupParity &p = entry.parities[first];
+    int missing = -1;
+    bool usable = true;  // every section we have is still in memory
+    for (uint32_t i = first; i < first + p.count; i++) {
+        if (entry.parts.has(i)) {
+            usable = usable && entry.staged.count(i);
+            continue;
+        }
+        if (missing >= 0) return -1;  // XOR can only rebuild one
+        missing = i;
+    }
+
+    seq_t recovered = -1;
+    if (missing >= 0 && usable) {
+        // XOR out everything we have, what's left is the missing section
+        uint16_t len = p.lenxor;
+        uint8_t *data = p.xordata.data;
+        for (uint32_t i = first; i < first + p.count; i++) {
+            if (i == (uint32_t)missing) continue;
+            FileSegment &s = entry.staged[i];
+            len ^= s.len;
+            for (uint32_t j = 0; j < s.len; j++) data[j] ^= s.data[j];
+        }
+        // only the last section may be short, a garbled parity can say
+        // anything
+        bool last = (uint32_t)missing == entry.parts.size() - 1;
+        if (last ? len == 0 || len > entry.secsize : len != entry.secsize) {
+            c150debug->printf(C150APPLICATION,
+                              "Dropped parity rebuilding section %d with %d "
+                              "bytes\n",
+                              missing, len);
+        } else {
+            c150debug->printf(C150APPLICATION,
+                              "Rebuilt section %d (%d bytes) from parity\n",
+                              missing, len);
+            FileSegment section;
+            section.len = len;
+            section.data = data;  // parity buffer now belongs to it
+            p.xordata.data = nullptr;
+            stageSection(entry, missing, section);
+            recovered = p.seqno - p.count + (missing - first);
+        }
+    }
+
+    if (p.xordata.data) entry.arena->free(p.xordata.data);
+    entry.parities.erase(first);
+    return recovered;
+}
+
+void Filecache::startTemp(int id) {
+    CacheEntry &entry = m_cache[id];
+    string tmpfile = makeTmpFileName(m_dir, entry.filename);
+    long size = (long)entry.parts.size() * entry.secsize;
+    entry.hash = make_shared<RunningHash>();
+    entry.flushed = 0;
+    entry.written = {};
+    diskJob(
+        id,
+        [tmpfile, size](C150NastyFile *nfp) {
+            touch(nfp, tmpfile);
+            setFileSize(tmpfile, size);
+        },
+        []() {});
+}
 
-    uint8_t *buffer = (uint8_t *)malloc(sumlen);
+void Filecache::flushStaged(int id) {
+    CacheEntry &entry = m_cache[id];
+    if (entry.stagedBytes < STREAM_CHUNK) return;
 
-    sumlen = 0;
-    for (auto s : fs) {
-        memcpy(buffer + sumlen, s.data, s.len);
-        sumlen += s.len;
+    // Sections come about in order, so a parity can only be waiting on the
+    // newest ones. Stop at the first one still missing.
+    uint32_t newest = entry.staged.rbegin()->first;
+    map<uint32_t, FileSegment> out;
+    for (auto it = entry.staged.begin();
+         it != entry.staged.end() && it->first == entry.flushed &&
+         it->first + MAX_FEC_GROUP <= newest;
+         it = entry.staged.erase(it), entry.flushed++) {
+        entry.stagedBytes -= it->second.len;
+        out.insert(*it);
     }
+    if (out.empty()) return;
 
-    *buffer_pp = buffer;
-    return sumlen;
+    string tmpfile = makeTmpFileName(m_dir, entry.filename);
+    uint32_t secsize = entry.secsize;
+    shared_ptr<SectionArena> arena = entry.arena;
+    shared_ptr<RunningHash> hash = entry.hash;
+    diskJob(
+        id,
+        [tmpfile, secsize, out, hash](C150NastyFile *nfp) {
+            writeSections(nfp, tmpfile, secsize, out, -1, hash.get());
+        },
+        [arena, out]() { freeSections(arena.get(), out); });
+}
+
+void Filecache::finishIfComplete(int id, seq_t seqno) {
+    CacheEntry &entry = m_cache[id];
+    // if any sections are still missing, we are still partial
+    if (!entry.parts.complete()) return;
+
+    // if none are missing, move to TMP
+    entry.seqno = seqno;  // for TMP entries, seqno is the most recent
+                          // filecheck or when file was finished
+    partialToTemp(id);
 }
 
 void Filecache::partialToTemp(int id) {
     CacheEntry &entry = m_cache[id];
-    entry.status = FileStatus::TMP;
+    string tmpfile = makeTmpFileName(m_dir, entry.filename);
 
-    // Move section data to a buffer
-    uint8_t *buffer = nullptr;
-    uint32_t buflen = joinBuffers(m_cache[id].sections, &buffer);
-    m_cache[id].deleteSections();
+    // The rest of the sections now belong to whoever writes them out
+    map<uint32_t, FileSegment> rest;
+    rest.swap(entry.staged);
+    shared_ptr<SectionArena> arena = entry.arena;
+    entry.deleteSections();  // and any parities left over
 
-    // Move buffer to a tmp file
-    string tmpfile = makeTmpFileName(m_dir, m_cache[id].filename);
-    touch(m_nfp, tmpfile);
-    bufferToFile(m_nfp, tmpfile, buffer, buflen);
-    free(buffer);
+    // Writing takes long, keep answering packets meanwhile
+    entry.status = FileStatus::WRITING;
+    seq_t seqno = entry.seqno;
+    uint32_t secsize = entry.secsize;
+    long size = entry.size;
+    shared_ptr<RunningHash> hash = entry.hash;
+    // written by the worker, read once it's done
+    shared_ptr<WriteReceipt> written = make_shared<WriteReceipt>();
+    diskJob(
+        id,
+        [tmpfile, secsize, rest, size, hash, written](C150NastyFile *nfp) {
+            writeSections(nfp, tmpfile, secsize, rest, size, hash.get());
+            if (hash->broken || hash->hashed != size) return;
+            EVP_DigestFinal_ex(hash->ctx, written->checksum, NULL);
+            written->size = size;
+            written->ok = stampFile(tmpfile, &written->stamp);
+        },
+        [this, id, seqno, arena, rest, written]() {
+            freeSections(arena.get(), rest);
+            writeDone(id, seqno, *written);
+        });
 }
 
-void Filecache::CacheEntry::deleteSections() {
-    for (auto &section : sections) {
-        free(section.data);
-        section.data = nullptr;
-        section.len = 0;
+void Filecache::writeSections(C150NastyFile *nfp, string tmpfile,
+                              uint32_t secsize,
+                              const map<uint32_t, FileSegment> &sections,
+                              long size, RunningHash *hash) {
+    // Sections that follow each other in the file usually do in the arena
+    // too, those go out as one range
+    vector<FileRange> ranges;
+    for (auto &kv_pair : sections) {
+        long offset = (long)kv_pair.first * secsize;
+        const FileSegment &s = kv_pair.second;
+        if (!ranges.empty()) {
+            FileRange &last = ranges.back();
+            if (last.offset + last.len == offset &&
+                last.data + last.len == s.data) {
+                last.len += s.len;
+                continue;
+            }
+        }
+        ranges.push_back({offset, s.data, s.len});
+    }
+    // the end to end check catches whatever didn't make it
+    if (!writeRanges(nfp, tmpfile, ranges)) {
+        c150debug->printf(C150APPLICATION,
+                          "Failed to write %d ranges of %s\n",
+                          ranges.size(), tmpfile.c_str());
+        hash->broken = true;
     }
+
+    // What read back right is what we have in memory. Sections are written
+    // in file order, each batch carrying on from the last, so a range that
+    // doesn't follow what's hashed means something went wrong: the CHECK
+    // reads the file back instead.
+    for (const FileRange &r : ranges) {
+        if (hash->broken) break;
+        if (r.offset != hash->hashed) {
+            hash->broken = true;
+            break;
+        }
+        EVP_DigestUpdate(hash->ctx, r.data, r.len);
+        hash->hashed += r.len;
+    }
+
+    if (size >= 0) setFileSize(tmpfile, size);
+}
+
+void Filecache::freeSections(SectionArena *arena,
+                             const map<uint32_t, FileSegment> &sections) {
+    for (auto &kv_pair : sections) arena->free(kv_pair.second.data);
+}
+
+void Filecache::diskJob(int id, function<void(C150NastyFile *)> job,
+                        function<void()> done) {
+    if (!m_disk) {
+        job(m_nfp);
+        done();
+        return;
+    }
+    m_diskJobs++;
+    m_disk->submit(id, job, [this, done]() {
+        m_diskJobs--;
+        done();
+    });
+}
+
+void Filecache::writeDone(int id, seq_t seqno, const WriteReceipt &written) {
+    auto it = m_cache.find(id);
+    // unless the client started the file over while it was being written
+    if (it == m_cache.end() || it->second.status != FileStatus::WRITING ||
+        it->second.seqno != seqno)
+        return;
+    c150debug->printf(C150APPLICATION, "Finished writing file %s\n",
+                      it->second.filename.c_str());
+    it->second.status = FileStatus::TMP;
+    it->second.written = written;
+    if (m_diskDone) m_diskDone(id);
+}
+
+bool Filecache::writtenUnchanged(const CacheEntry &entry) {
+    if (!entry.written.ok) return false;
+    FileStamp now;
+    return stampFile(makeTmpFileName(m_dir, entry.filename), &now) &&
+           now == entry.written.stamp;
+}
+
+void Filecache::submitCheck(int id, string file, const checksum_t checksum) {
+    CacheEntry &entry = m_cache[id];
+    entry.status = FileStatus::CHECKING;
+    seq_t seqno = entry.seqno;
+    array<unsigned char, SHA_DIGEST_LENGTH> expected;
+    memcpy(expected.data(), checksum, SHA_DIGEST_LENGTH);
+    // written by the worker, read once it's done
+    shared_ptr<bool> ok = make_shared<bool>(false);
+    diskJob(
+        id,
+        [file, expected, ok](C150NastyFile *nfp) {
+            *ok = filecheck(nfp, file, expected.data());
+        },
+        [this, id, seqno, ok]() { checkDone(id, seqno, *ok); });
+}
+
+void Filecache::checkDone(int id, seq_t seqno, bool ok) {
+    auto it = m_cache.find(id);
+    // unless the client started the file over while it was being checked
+    if (it == m_cache.end() || it->second.status != FileStatus::CHECKING ||
+        it->second.seqno != seqno)
+        return;
+    CacheEntry &entry = it->second;
+    c150debug->printf(C150APPLICATION, "Finished checking file %s: %s\n",
+                      entry.filename.c_str(), ok ? "good" : "bad");
+    if (entry.existing) {
+        // as idempotentCheckfile does for a file it never heard of
+        entry.existing = false;
+        if (ok) {
+            entry.status = FileStatus::SAVED;
+        } else {
+            entry.status = FileStatus::TMP;
+            rename(makeFileName(m_dir, entry.filename).c_str(),
+                   makeTmpFileName(m_dir, entry.filename).c_str());
+        }
+    } else {
+        // a failed check stays TMP with its seqno, so asking again gets SOS
+        entry.status = ok ? FileStatus::VERIFIED : FileStatus::TMP;
+    }
+    if (m_diskDone) m_diskDone(id);
+}
+
+void Filecache::CacheEntry::deleteSections() {
+    // The old arena goes, slabs and all, once no disk job needs it
+    arena = make_shared<SectionArena>(secsize);
+    staged.clear();
+    stagedBytes = 0;
+    parities.clear();
 }
@@ -1,15 +1,23 @@
 #ifndef FILECACHE_H
 #define FILECACHE_H
 
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
 #include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
 #include <tuple>
 #include <unordered_map>
 #include <vector>
 
+#include "arena.h"
 #include "c150nastyfile.h"
+#include "diskio.h"
+#include "diskpool.h"
 #include "messenger.h"
+#include "reassembly.h"
 
 /***
  * Implementation requires a bit more consideration and thought
@@ -17,7 +25,24 @@
 
 class Filecache {
    public:
-    Filecache(std::string dir, C150NETWORK::C150NastyFile *nfp);
+    // Writes sections out on disk's workers as they arrive, or right away
+    // with nfp if there is no disk
+    Filecache(std::string dir, C150NETWORK::C150NastyFile *nfp,
+              DiskPool *disk = nullptr);
+
+    // True if the answer to this check has to wait for the disk workers:
+    // the file is still being written, or being verified. Starts verifying
+    // it on a worker if that's next, and idempotentCheckfile has the answer
+    // once it's done. Always false without disk workers.
+    bool checkPending(int id, seq_t seqno, const std::string filename,
+                      const unsigned char checksum[SHA_DIGEST_LENGTH]);
+
+    // Calls cb with the file's id every time a write or a check finishes
+    void onDiskDone(std::function<void(int)> cb) { m_diskDone = cb; }
+
+    // True while disk jobs of this cache are waiting or running. They refer
+    // back to it, so it must not be destroyed until this is false.
+    bool diskBusy() const { return m_diskJobs > 0; }
 
     // No need to be careful about repeatedly calling these
 
@@ -31,38 +56,162 @@ class Filecache {
     // responds SOS if file already verified as correct and saved to disk
     bool idempotentDeleteTmp(int id, seq_t seqno);
 
-    // always ACK
+    // SOS if nparts and secsize don't make a file we could take (see
+    // MAX_BLOB_SIZE), else ACK
     bool idempotentPrepareForFile(int id, seq_t seqno,
-                                  const std::string filename, uint32_t nparts);
-
-    // responds SOS if file is not yet mentioned
+                                  const std::string filename, uint32_t nparts,
+                                  uint32_t secsize);
+
+    // Like idempotentPrepareForFile, except that a PARTIAL file
+    // keeps the sections it has. Fills missing with the sections the file
+    // still needs, which is none once it is complete.
+    bool idempotentResumeFile(int id, seq_t seqno, const std::string filename,
+                              uint32_t nparts, uint32_t secsize,
+                              std::vector<PartRange> &missing);
+
+    // responds SOS if file is not yet mentioned, or the section doesn't fit
+    // it. If a parity received
+    // earlier lets this section complete its group, rebuilds the group's
+    // last missing section and sets *recovered to its seqno (else -1).
     bool idempotentStoreFileChunk(int id, seq_t seqno, uint32_t partno,
-                                  uint8_t *data, uint32_t len);
+                                  uint8_t *data, uint32_t len,
+                                  seq_t *recovered);
+
+    // responds SOS if file is not yet mentioned. Rebuilds the section the
+    // parity's group is missing, if it's only missing one, and sets
+    // *recovered to its seqno (else -1). Otherwise keeps the parity until
+    // enough of the group arrives.
+    bool idempotentStoreParity(int id, seq_t seqno, const BlobParity *parity,
+                               uint32_t len, seq_t *recovered);
 
    private:
-    bool filecheck(string filename,
-                   const unsigned char checksum[SHA_DIGEST_LENGTH]);
+    // On any thread
+    static bool filecheck(C150NETWORK::C150NastyFile *nfp, string filename,
+                          const unsigned char checksum[SHA_DIGEST_LENGTH]);
 
-    enum FileStatus { PARTIAL, TMP, VERIFIED, SAVED };
+    enum FileStatus { PARTIAL, WRITING, CHECKING, TMP, VERIFIED, SAVED };
     struct FileSegment {
         uint32_t len = 0;
         uint8_t *data = nullptr;
     };
+    struct GroupParity {
+        seq_t seqno;  // of the parity, the group's seqnos come right before
+        uint32_t count;
+        uint16_t lenxor;
+        FileSegment xordata;
+    };
+    // SHA1 of the start of a file, as far as its sections are known to be
+    // right on disk. Only the file's disk worker touches it until the last
+    // of them is written.
+    struct RunningHash {
+        EVP_MD_CTX *ctx;
+        long hashed = 0;      // bytes
+        bool broken = false;  // something wasn't, or came out of order
+        RunningHash() : ctx(EVP_MD_CTX_new()) {
+            EVP_DigestInit_ex(ctx, EVP_sha1(), NULL);
+        }
+        ~RunningHash() { EVP_MD_CTX_free(ctx); }
+        RunningHash(const RunningHash &) = delete;
+        RunningHash &operator=(const RunningHash &) = delete;
+    };
     struct CacheEntry {
         // ordered by maturity
         FileStatus status;
         seq_t seqno;
         std::string filename;
-        std::vector<FileSegment> sections;
+        uint32_t secsize = 0;  // bytes in every section but the last
+        long size = -1;        // of the whole file, once the last section is in
+        Reassembly parts;  // which sections arrived
+        // Sections received but not yet written to the .tmp file. Only
+        // these can help rebuild a section from parity.
+        std::map<uint32_t, FileSegment> staged;
+        // Where staged sections and parities live. Disk jobs hold on to it
+        // until the sections they write are freed.
+        std::shared_ptr<SectionArena> arena;
+        size_t stagedBytes = 0;
+        // Sections before this one have been handed to the disk, in order
+        uint32_t flushed = 0;
+        std::map<uint32_t, GroupParity> parities;  // by first partno
+        bool existing = false;  // CHECKING a file we never got, not a .tmp
+        // Hashes sections as they are written, so a CHECK of the .tmp file
+        // needn't read it back
+        std::shared_ptr<RunningHash> hash;
+        // The .tmp file's checksum and stamp, once written, if hash made it
+        // to the end. Not ok if the disk has to be read to check it.
+        WriteReceipt written = {};
+
+        CacheEntry() : status(PARTIAL), seqno(0) {}
+        CacheEntry(FileStatus status, seq_t seqno, std::string filename,
+                   uint32_t secsize = 0)
+            : status(status), seqno(seqno), filename(filename),
+              secsize(secsize) {}
+
+        // Drops every section and parity in memory, for a fresh arena
         void deleteSections();
     };
 
-    uint32_t joinBuffers(vector<FileSegment> fs, uint8_t **buffer);
-
-    // Takes the id of a completed cache entry and saves it to disk as a tmp
-    // file. Frees the sections in the cache entry and sets the status to TMP.
+    // Keeps a received section until it is written out
+    static void stageSection(CacheEntry &entry, uint32_t partno,
+                             FileSegment section);
+
+    // If the group of the parity at first is missing exactly one section,
+    // rebuilds it and returns its seqno. Returns -1 otherwise. Drops the
+    // parity once the group is whole, or when its sections were written out
+    // before it could help.
+    seq_t recoverSection(CacheEntry &entry, uint32_t first);
+
+    // Creates the entry's .tmp file, full size, for sections to be written
+    // into as they arrive, and starts hashing them from the first
+    void startTemp(int id);
+
+    // Writes the entry's staged sections to its .tmp file, once there are
+    // STREAM_CHUNK bytes of them. Only the run that carries on from the
+    // sections already written goes, so they reach the hash in file order:
+    // sections past a missing one wait in memory until it arrives. Keeps the
+    // last group's worth back, a parity may still need them.
+    void flushStaged(int id);
+
+    // Moves a PARTIAL entry with every section to TMP
+    void finishIfComplete(int id, seq_t seqno);
+
+    // Takes the id of a completed cache entry and writes the rest of its
+    // sections out, on the disk workers if there are any (status WRITING
+    // until they're done). Sets the status to TMP once the file is written.
     void partialToTemp(int id);
 
+    // Writes each section at partno * secsize into tmpfile and adds the
+    // ones that follow what hash covers to it, then sets the file's size if
+    // size isn't -1. On any thread.
+    static void writeSections(C150NETWORK::C150NastyFile *nfp, string tmpfile,
+                              uint32_t secsize,
+                              const std::map<uint32_t, FileSegment> &sections,
+                              long size, RunningHash *hash);
+
+    // Gives the sections' buffers back to the arena they came from
+    static void freeSections(SectionArena *arena,
+                             const std::map<uint32_t, FileSegment> &sections);
+
+    // Runs job on the file's disk worker, in order with its other jobs, or
+    // right away with m_nfp if there is no disk
+    void diskJob(int id, std::function<void(C150NETWORK::C150NastyFile *)> job,
+                 std::function<void()> done);
+
+    // A disk worker wrote the file the entry had at seqno
+    void writeDone(int id, seq_t seqno, const WriteReceipt &written);
+
+    // True if the entry's .tmp file is still just as it was written, so
+    // entry.written.checksum is what a read of it would give
+    bool writtenUnchanged(const CacheEntry &entry);
+
+    // Verifies file against checksum on a disk worker (status CHECKING
+    // until it's done)
+    void submitCheck(int id, string file,
+                     const unsigned char checksum[SHA_DIGEST_LENGTH]);
+
+    // A disk worker verified the file the entry had at seqno, ok if it
+    // matched
+    void checkDone(int id, seq_t seqno, bool ok);
+
     /*
      * filename -> ( FileStatus, min seq for redo, [ section1, NULL, ... ])
      */
@@ -70,6 +219,9 @@ class Filecache {
 
     std::string m_dir;
     C150NETWORK::C150NastyFile *m_nfp;
+    DiskPool *m_disk;
+    std::function<void(int)> m_diskDone;
+    int m_diskJobs;  // waiting or running
 };
 
 #endif
@@ -1,4 +1,5 @@
 #include <dirent.h>
+#include <unistd.h>
 
 #include <cstdio>
 #include <cstdlib>
@@ -12,6 +13,7 @@
 #include "clientmanager.h"
 #include "diskio.h"
 #include "settings.h"
+#include "udpsocket.h"
 #include "utils.h"
 
 using namespace C150NETWORK;
@@ -21,25 +23,65 @@ int main(int argc, char **argv) {
     // GRADEME(argc, argv);
     setUpDebugLogging("clientlog.txt", argc, argv);
 
-    if (argc != 5) {
-        fprintf(
-            stderr,
-            "Usage: %s <server> <networknastiness> <filenastiness> <srcdir>\n",
-            argv[0]);
+    // Parse options
+    string congestion_control = DEFAULT_CONGESTION_CONTROL;
+    bool error_correction = false;
+    double pacing_rate = 0;  // KB/s, 0 to pace from the window
+    int pacing_burst = PACING_BURST;
+    double max_rate = 0;  // KB/s, 0 for no cap
+    int datagram_size = 0;  // 0 to probe for the largest that works
+    int opt;
+    while ((opt = getopt(argc, argv, "c:fr:b:m:s:")) != -1) {
+        switch (opt) {
+            case 'c':
+                congestion_control = optarg;
+                break;
+            case 'f':
+                error_correction = true;
+                break;
+            case 'r':
+                pacing_rate = atof(optarg);
+                break;
+            case 'b':
+                pacing_burst = atoi(optarg);
+                break;
+            case 'm':
+                max_rate = atof(optarg);
+                break;
+            case 's':
+                datagram_size = atoi(optarg);
+                break;
+            default:
+                argc = -1;  // print usage below
+        }
+    }
+
+    if (datagram_size != 0 && (datagram_size < MAX_PACKET_SIZE ||
+                               datagram_size > MAX_DATAGRAM_SIZE)) {
+        fprintf(stderr, "Datagram size must be between %d and %d bytes\n",
+                MAX_PACKET_SIZE, MAX_DATAGRAM_SIZE);
+        argc = -1;  // print usage below
+    }
+
+    if (argc - optind != 4) {
+        fprintf(stderr,
+                "Usage: %s [-c reno|delay] [-f] [-r KB/s] [-b packets] "
+                "[-m KB/s] [-s bytes] <server> <networknastiness> "
+                "<filenastiness> <srcdir>\n",
+                argv[0]);
         exit(EXIT_FAILURE);
     }
 
     // Parse arguments
-    char *server_name = argv[1];
-    int network_nastiness = atoi(argv[2]);
-    int file_nastiness = atoi(argv[3]);
-    char *srcdir = argv[4];
+    char *server_name = argv[optind];
+    int network_nastiness = atoi(argv[optind + 1]);
+    int file_nastiness = atoi(argv[optind + 2]);
+    char *srcdir = argv[optind + 3];
 
-    checkDirectory(argv[4]);
+    checkDirectory(srcdir);
 
     // Set up socket
-    C150DgmSocket *sock = new C150NastyDgmSocket(network_nastiness);
-    sock->setServerName(server_name);
+    UdpSocket *sock = new UdpSocket(network_nastiness, server_name);
 
     // Set up file handler
     C150NastyFile *nfp = new C150NastyFile(file_nastiness);
@@ -52,7 +94,7 @@ int main(int argc, char **argv) {
     struct dirent *sourceFile;  // Directory entry for source file
 
     if (src == NULL) {
-        fprintf(stderr, "Error opening source directory %s\n", argv[2]);
+        fprintf(stderr, "Error opening source directory %s\n", srcdir);
         exit(8);
     }
 
@@ -70,18 +112,28 @@ int main(int argc, char **argv) {
 
     ClientManager manager(nfp, string(srcdir), &filenames);
     Messenger messenger(sock);
+    if (!messenger.setCongestionControl(congestion_control)) {
+        fprintf(stderr, "Unknown congestion control %s\n",
+                congestion_control.c_str());
+        exit(EXIT_FAILURE);
+    }
+    messenger.setErrorCorrection(error_correction);
+    messenger.setBandwidthCap(max_rate * 1024);
 
     try {
-        bool check_success = false;
-        while (!check_success) {
-            // Send files
-            manager.transfer(&messenger);
-            cerr << "File transfer complete, starting e2e" << endl;
-
-            check_success = manager.endToEndCheck(&messenger);
-            cerr << "End to end check " << (check_success ? "passed" : "failed")
+        // Agree on a datagram size with the server before anything else
+        size_t dgmsize = messenger.probeDatagramSize(datagram_size);
+        if (datagram_size > 0 && dgmsize != (size_t)datagram_size)
+            cerr << datagram_size << " byte datagrams don't get through"
                  << endl;
-        }
+        cerr << "Using " << dgmsize << " byte datagrams" << endl;
+        messenger.setPacing(pacing_rate * 1024, pacing_burst * dgmsize);
+
+        // Send files, each is E2E checked as soon as it's there
+        if (manager.transfer(&messenger))
+            cerr << "File transfer and end to end checks complete" << endl;
+        else
+            cerr << "Some files could not be copied" << endl;
     } catch (C150Exception &e) {
         cerr << "fileclient: Caught C150Exception: " << e.formattedExplanation()
              << endl;
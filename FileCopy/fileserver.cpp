@@ -1,54 +1,118 @@
 
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cstdio>
+#include <thread>
+#include <vector>
 
 #include "c150debug.h"
 #include "c150grading.h"
-#include "c150nastydgmsocket.h"
 #include "c150nastyfile.h"
+#include "diskpool.h"
 #include "responder.h"
+#include "udpsocket.h"
 #include "utils.h"
 
 using namespace C150NETWORK;
 
+// One listener: its own socket, nasty file handler, disk workers and
+// clients, on one CPU
+static void serve(int cpu, UdpSocket *sock, C150NastyFile *nfp,
+                  DiskPool *disk, string dir) {
+    if (cpu >= 0) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+            c150debug->printf(C150ALWAYSLOG,
+                              "Couldn't pin listener to CPU %d\n", cpu);
+    }
+
+    try {
+        listen(sock, nfp, disk, dir);
+    } catch (C150NetworkException &e) {
+        // Write to debug log
+        c150debug->printf(C150ALWAYSLOG, "Caught C150NetworkException: %s\n",
+                          e.formattedExplanation().c_str());
+        // In case we're logging to a file, write to the console too
+        cerr << "fileserver: caught C150NetworkException: "
+             << e.formattedExplanation() << endl;
+    }
+}
+
 int main(int argc, char **argv) {
     // TODO: uncomment
     // GRADEME(argc, argv);
     setUpDebugLogging("serverlog.txt", argc, argv);
 
-    if (argc != 4) {
+    // Parse options
+    int threads = 1;
+    int workers = -1;  // unless -w, a share of the CPUs (see below)
+    int opt;
+    while ((opt = getopt(argc, argv, "t:w:")) != -1) {
+        switch (opt) {
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'w':
+                workers = atoi(optarg);
+                if (workers < 0) argc = -1;
+                break;
+            default:
+                argc = -1;  // print usage below
+        }
+    }
+
+    if (argc - optind != 3 || threads < 1) {
         fprintf(stderr,
-                "Usage: %s <networknastiness> <filenastiness> <targetdir>\n",
+                "Usage: %s [-t threads] [-w diskworkers] <networknastiness> "
+                "<filenastiness> <targetdir>\n",
                 argv[0]);
         exit(EXIT_FAILURE);
     }
 
     // Parse arguments
-    int network_nastiness = atoi(argv[1]);
-    int file_nastiness = atoi(argv[2]);
-    char *targetdir = argv[3];
-
-    // Set up socket
-    C150DgmSocket *sock = new C150NastyDgmSocket(network_nastiness);
+    int network_nastiness = atoi(argv[optind]);
+    int file_nastiness = atoi(argv[optind + 1]);
+    char *targetdir = argv[optind + 2];
 
+    // With more than one listener, each gets a socket of its own on the
+    // same port (the kernel spreads clients among them), and a CPU
+    int ncpus = thread::hardware_concurrency();
+    if (workers == -1) workers = max(DISK_WORKERS, ncpus / threads);
+    // Set up sockets, all of them before anything else opens files (see
+    // udpsocket.cpp)
+    vector<UdpSocket *> socks;
+    for (int i = 0; i < threads; i++)
+        socks.push_back(new UdpSocket(network_nastiness, threads > 1));
     c150debug->printf(C150APPLICATION,
-                      "Set up server socket with nastiness %d\n",
+                      "Set up %d server sockets with nastiness %d\n", threads,
                       network_nastiness);
 
-    // Set up file socket
-    C150NastyFile *nfp = new C150NastyFile(file_nastiness);
+    vector<thread> listeners;
+    for (int i = 0; i < threads; i++) {
+        UdpSocket *sock = socks[i];
 
-    c150debug->printf(C150APPLICATION, "Set up file handler nastiness %d\n",
-                      file_nastiness);
+        // Set up file handler
+        C150NastyFile *nfp = new C150NastyFile(file_nastiness);
 
-    try {
-        listen(sock, nfp, string(targetdir));
-    } catch (C150NetworkException &e) {
-        // Write to debug log
-        c150debug->printf(C150ALWAYSLOG, "Caught C150NetworkException: %s\n",
-                          e.formattedExplanation().c_str());
-        // In case we're logging to a file, write to the console too
-        cerr << argv[0]
-             << ": caught C150NetworkException: " << e.formattedExplanation()
-             << endl;
+        c150debug->printf(C150APPLICATION,
+                          "Set up file handler nastiness %d\n",
+                          file_nastiness);
+
+        // Set up disk workers, with file handlers of their own
+        DiskPool *disk =
+            workers > 0 ? new DiskPool(workers, file_nastiness) : nullptr;
+
+        int cpu = threads > 1 && ncpus > 0 ? i % ncpus : -1;
+        if (threads == 1)
+            serve(cpu, sock, nfp, disk, string(targetdir));
+        else
+            listeners.emplace_back(serve, cpu, sock, nfp, disk,
+                                   string(targetdir));
     }
+    for (thread &t : listeners) t.join();
 }
@@ -1,7 +1,11 @@
 #include "messenger.h"
 
+#include <algorithm>
 #include <cassert>
-#include <unordered_map>
+#include <cstddef>
+#include <cstring>
+#include <map>
+#include <unordered_set>
 #include <vector>
 
 #include "c150debug.h"
@@ -11,15 +15,260 @@
 using namespace C150NETWORK;
 using namespace std;
 
-Messenger::Messenger(C150DgmSocket *sock) {
+// Datagram sizes probeDatagramSize() tries, largest first: the most UDP can
+// carry, jumbo Ethernet frames, and plain Ethernet
+static const size_t ETHERNET_DGM_SIZE = 1472;
+static const size_t PROBE_SIZES[] = {MAX_DATAGRAM_SIZE, 8972,
+                                     ETHERNET_DGM_SIZE};
+
+class Messenger::Source {
+   public:
+    virtual ~Source() {}
+
+    // Fills in the next message, all but its seqno. Returns false once
+    // there are none left.
+    virtual bool next(Outgoing &out) = 0;
+};
+
+class Messenger::PacketSource : public Messenger::Source {
+   public:
+    PacketSource(vector<Packet> &packets) : m_packets(packets), m_next(0) {}
+
+    bool next(Outgoing &out) {
+        if (m_next == m_packets.size()) return false;
+        Packet &p = m_packets[m_next++];
+        out.head.hdr = p.hdr;
+        out.packet = &p;
+        out.data = nullptr;
+        out.datalen = 0;
+        return true;
+    }
+
+   private:
+    vector<Packet> &m_packets;
+    size_t m_next;
+};
+
+class Messenger::SectionSource : public Messenger::Source {
+    // Sections are written as a SectionHeader followed by the data
+    static_assert(offsetof(Packet, value.section.data) ==
+                      sizeof(SectionHeader),
+                  "SectionHeader must match the start of a BLOB_SECTION");
+
+   public:
+    // parts[i] lists the sections of blobs[i] to send
+    SectionSource(const vector<Blob> &blobs,
+                  const vector<vector<PartRange>> &parts, Messenger *owner)
+        : m_blobs(blobs),
+          m_parts(parts),
+          m_owner(owner),
+          m_secsize(sectionDataSize(owner->m_dgmSize)),
+          m_blob(0),
+          m_range(0),
+          m_partno(0),
+          m_groupBlob(0),
+          m_first(0),
+          m_end(0),
+          m_group(0) {}
+
+    bool next(Outgoing &out) {
+        bool more = advance();
+
+        // close the current parity group once it's full, or the next section
+        // doesn't carry on from it
+        if (m_group > 0) {
+            uint32_t n = m_end - m_first;
+            if (n == m_group || !more || m_blob != m_groupBlob ||
+                m_partno != m_end) {
+                const Blob &b = m_blobs[m_groupBlob];
+                size_t pos = m_first * m_secsize;
+                size_t len = min(n * m_secsize, b.len - pos);
+                fill(out, BLOB_PARITY, b.id, m_first, b.data + pos, len);
+                m_group = 0;
+                return true;
+            }
+        }
+        if (!more) return false;
+
+        if (m_group == 0) {  // start a new group
+            m_group = m_owner->fecGroup();
+            m_groupBlob = m_blob;
+            m_first = m_partno;
+        }
+
+        const Blob &b = m_blobs[m_blob];
+        size_t pos = m_partno * m_secsize;
+        size_t len = min(m_secsize, b.len - pos);
+        fill(out, BLOB_SECTION, b.id, m_partno++, b.data + pos, len);
+        m_end = m_partno;
+        return true;
+    }
+
+   private:
+    // Moves m_partno to the next section to send, on to later ranges and
+    // blobs as needed. Returns false once there are none left.
+    bool advance() {
+        for (; m_blob < m_blobs.size(); m_blob++, m_range = 0, m_partno = 0) {
+            const vector<PartRange> &ranges = m_parts[m_blob];
+            for (; m_range < ranges.size(); m_range++) {
+                if (m_partno < ranges[m_range].first)
+                    m_partno = ranges[m_range].first;
+                if (m_partno <= ranges[m_range].last) return true;
+            }
+        }
+        return false;
+    }
+
+    void fill(Outgoing &out, MessageType type, fid_t fid, uint32_t partno,
+              const uint8_t *data, size_t len) {
+        out.head.hdr.len = sizeof(SectionHeader) + len;
+        out.head.hdr.type = type;
+        out.head.hdr.seqno = -1;
+        out.head.hdr.fid = fid;
+        out.head.partno = partno;
+        out.packet = nullptr;
+        out.data = data;
+        out.datalen = len;
+    }
+
+    const vector<Blob> &m_blobs;
+    const vector<vector<PartRange>> &m_parts;
+    Messenger *m_owner;
+    size_t m_secsize;     // data bytes per section
+    size_t m_blob;        // index of the blob being sectioned
+    size_t m_range;       // index of the range of its parts being sent
+    uint32_t m_partno;    // next section to send
+    size_t m_groupBlob;   // blob of the current parity group
+    uint32_t m_first;     // first section of the current parity group
+    uint32_t m_end;       // one past its last section so far
+    uint32_t m_group;     // size of the current parity group, 0 if none
+};
+
+Messenger::Messenger(UdpSocket *sock, EventLoop *loop) {
     m_sock = sock;
-    m_sock->turnOnTimeouts(MESSENGER_TIMEOUT);
+    m_ownLoop = loop == nullptr;
+    m_loop = m_ownLoop ? new EventLoop() : loop;
     m_seqno = 0;
+    m_lastSent = -1;
+    m_recover = -1;
+    m_fec = false;
+    m_lossRate = 0;
+    m_lastBackoff = clock::now();
+    m_pacingRate = 0;
+    m_dgmSize = MAX_PACKET_SIZE;
+    m_paritiesUsed = 0;
+    m_inbox.resize(MAX_BURST);
+    m_maxRate = 0;
+    m_cc = makeCongestionController(DEFAULT_CONGESTION_CONTROL);
+    assert(m_cc);
 
     c150debug->printf(C150APPLICATION, "Set up manager\n");
 }
 
-Messenger::~Messenger() {}
+Messenger::~Messenger() {
+    clearInflight();
+    for (auto &kv_pair : m_parked) m_loop->cancel(kv_pair.second.timer);
+    delete m_cc;
+    if (m_ownLoop) delete m_loop;
+}
+
+bool Messenger::setCongestionControl(string name) {
+    CongestionController *cc = makeCongestionController(name);
+    if (!cc) return false;
+    delete m_cc;
+    m_cc = cc;
+    c150debug->printf(C150APPLICATION, "Using %s congestion control\n",
+                      m_cc->name());
+    return true;
+}
+
+void Messenger::setErrorCorrection(bool on) { m_fec = on; }
+
+void Messenger::setPacing(double rate, double burst) {
+    m_pacingRate = rate;
+    m_pacer.setBurst(burst);
+}
+
+void Messenger::setBandwidthCap(double rate) { m_maxRate = rate; }
+
+void Messenger::setDatagramSize(size_t size) {
+    assert(size >= MAX_PACKET_SIZE && size <= MAX_DATAGRAM_SIZE);
+    m_dgmSize = size;
+    m_sock->sizeBuffers(size);
+    c150debug->printf(C150APPLICATION, "Using %d byte datagrams\n", size);
+}
+
+size_t Messenger::probeDatagramSize(size_t size) {
+    vector<size_t> sizes(begin(PROBE_SIZES), end(PROBE_SIZES));
+    if (size > 0) sizes.assign(1, size);
+
+    vector<PacketBuffer> probe(1);
+    memset(probe[0].bytes, 0, sizeof(probe[0].bytes));  // the padding
+    Packet &p = probe[0].packet;
+
+    // The server answers with a SACK like for anything else
+    bool through = false;
+    m_loop->watch(m_sock->fd(), [&]() {
+        char *bufs[MAX_BURST];
+        ssize_t lens[MAX_BURST];
+        for (int i = 0; i < MAX_BURST; i++) bufs[i] = (char *)&m_inbox[i];
+        int nread = m_sock->readMany(bufs, MAX_DATAGRAM_SIZE, lens, MAX_BURST);
+        for (int i = 0; i < nread; i++) {
+            Packet &r = m_inbox[i].packet;
+            if (lens[i] != r.hdr.len || r.hdr.type != SACK) continue;
+            if (r.sacks(p.hdr.seqno)) through = true;
+        }
+    });
+
+    // A probe that IP splits into fragments still gets through, but then
+    // one lost fragment loses the whole section. So probes may not be
+    // fragmented: too big for the link and the socket refuses them, too big
+    // for the path and they are dropped. Without that, only sizes that fit
+    // a plain Ethernet frame are tried. A size asked for is tried as it is,
+    // fragments and all.
+    bool dontFragment = false;
+    if (!size) {
+        dontFragment = m_sock->setDontFragment(true);
+        if (!dontFragment)
+            c150debug->printf(C150APPLICATION,
+                              "Can't stop probes being fragmented, trying %d "
+                              "bytes at most\n",
+                              ETHERNET_DGM_SIZE);
+    }
+
+    size_t found = MAX_PACKET_SIZE;
+    for (size_t tried : sizes) {
+        if (!dontFragment && !size && tried > ETHERNET_DGM_SIZE) continue;
+        p.ofProbe(tried);
+        p.hdr.seqno = m_seqno++;
+        for (int attempt = 0; attempt < PROBE_ATTEMPTS && !through;
+             attempt++) {
+            const char *buf = (const char *)&p;
+            ssize_t len = tried;
+            if (!m_sock->writeMany(&buf, &len, 1)) break;  // bigger than MTU
+            clock::time_point deadline =
+                clock::now() + chrono::milliseconds(PROBE_TIMEOUT);
+            for (clock::time_point now = clock::now();
+                 !through && now < deadline; now = clock::now()) {
+                auto left =
+                    chrono::duration_cast<chrono::milliseconds>(deadline - now);
+                m_loop->runOnce(left.count() + 1);
+            }
+        }
+        if (through) {
+            found = tried;
+            break;
+        }
+        c150debug->printf(C150APPLICATION,
+                          "%d byte datagrams don't get through\n", tried);
+    }
+
+    m_loop->unwatch(m_sock->fd());
+    // Sections go out like any other datagram, in case the path changes
+    if (dontFragment) m_sock->setDontFragment(false);
+    setDatagramSize(found);
+    return found;
+}
 
 bool Messenger::send_one(Packet &message) {
     vector<Packet> msgs(1, message);
@@ -28,125 +277,539 @@ bool Messenger::send_one(Packet &message) {
 
 // returns true if successful
 bool Messenger::send(vector<Packet> &messages) {
-    Packet *packets = messages.data();
-    int npackets = messages.size();
+    unordered_set<fid_t> failed;
+    return send(messages, failed);
+}
+
+bool Messenger::send(vector<Packet> &messages, unordered_set<fid_t> &failed) {
+    PacketSource source(messages);
+    bool ok = run(source, failed);
+
+    // run() is done with the rest, now wait for the PENDING ones
+    for (Packet &m : messages) {
+        if (failed.count(m.hdr.fid)) continue;  // never sent, or SOS'd
+        while (m_parked.count(m.hdr.seqno)) waitAnswered();
+        auto answer = m_answered.find(m.hdr.seqno);
+        if (answer == m_answered.end()) continue;
+        if (!answer->second) {
+            failed.insert(m.hdr.fid);
+            ok = false;
+        }
+        m_answered.erase(answer);
+    }
+    return ok;
+}
+
+bool Messenger::run(Source &source, unordered_set<fid_t> &failed) {
     // seq number of the "youngest" message in this group
     seq_t minseq = m_seqno;
+    m_progress = {minseq, &failed, 0, 0, true, false};
 
-    // Build map of messages to send and SOS's files
-    m_seqmap.clear();
+    clearInflight();
+    m_outPieces.clear();
+    m_outCounts.clear();
+    m_outHeads.clear();
+    m_paritiesUsed = 0;
 
-    c150debug->printf(C150APPLICATION,
-                      "Try to send %d messages, beginning with seqno %u\n",
-                      npackets, m_seqno);
+    c150debug->printf(C150APPLICATION, "Sending messages from seqno %u\n",
+                      m_seqno);
 
-    for (int i = 0; i < npackets; i++) {
-        packets[i].hdr.seqno = m_seqno;
-        m_seqmap[m_seqno] = &packets[i];
-        m_seqno++;
+    // Sliding window: keep up to window() messages in flight, refill the
+    // window as ACKs come in, and resend each message on its own deadline.
+    // The window never spans more than MAX_SEND_WINDOW seqnos, which the
+    // server relies on when folding old holes into its cumulative ACK.
+    //
+    // Everything happens on the event loop: ACKs are handled by
+    // onReadable() as they arrive, and each in-flight message has a timer
+    // for its deadline, so nothing ever polls.
+    m_loop->watch(m_sock->fd(), [this]() { onReadable(); });
+    Outgoing pending;  // the next message, not yet given a seqno
+    bool more = source.next(pending);
+    EventLoop::TimerId wakeup = 0;  // for when the pacer has room again
+    while ((more || !m_inflight.empty()) && !m_progress.gaveUp) {
+        clock::time_point now = clock::now();
+
+        // Refill the window with fresh messages, as fast as the pacer lets us
+        updatePacing();
+        bool room = false;
+        while (more && m_inflight.size() < window() &&
+               m_seqno - m_inflight.base() < MAX_SEND_WINDOW) {
+            room = m_pacer.ready(now);
+            if (!room) break;
+            if (!failed.count(pending.head.hdr.fid)) {  // else it got an SOS
+                pending.head.hdr.seqno = m_seqno;
+                if (pending.packet) pending.packet->hdr.seqno = m_seqno;
+                Outstanding &out = m_inflight.insert(
+                    m_seqno, {pending, now, now, 0, 0, 0});
+                m_seqno++;
+                transmit(out, now);
+            }
+            more = source.next(pending);
+        }
+        // The window has room the pacer won't let us use yet, come back
+        // when it will
+        if (more && !room && wakeup == 0 && m_inflight.size() < window() &&
+            m_seqno - m_inflight.base() < MAX_SEND_WINDOW)
+            wakeup = m_loop->at(m_pacer.whenReady(now),
+                                [&wakeup]() { wakeup = 0; });
+
+        // Everything queued above goes out in one system call
+        flushOutbox();
+
+        // Wait for ACKs or a deadline, whichever comes first. Resends the
+        // timers queue go out with the next flush.
+        m_loop->runOnce(MAX_RTO);
+        flushOutbox();
+    }
+    if (wakeup) m_loop->cancel(wakeup);
+    m_loop->unwatch(m_sock->fd());
+
+    if (m_progress.gaveUp) {
+        c150debug->printf(C150APPLICATION,
+                          "Failed to send messages from seqno %u after %d "
+                          "attempts\n",
+                          minseq, MAX_RESEND_ATTEMPTS);
+        m_inflight.forEach([&failed](seq_t, Outstanding &out) {
+            failed.insert(out.msg.head.hdr.fid);
+        });
+        for (; more; more = source.next(pending))
+            failed.insert(pending.head.hdr.fid);
+        clearInflight();
+        m_outPieces.clear();
+        m_outCounts.clear();
+        m_outHeads.clear();
+        m_paritiesUsed = 0;
+        return false;
     }
 
     c150debug->printf(C150APPLICATION,
-                      "Assigned packets and sequences to %d messages\n",
-                      npackets);
+                      "Completed send of %d messages, %d ACKs, %d resends, "
+                      "srtt %.2fms rttvar %.2fms rto %dms cwnd %d\n",
+                      m_seqno - minseq, m_progress.acked, m_progress.resent,
+                      m_rtt.srtt(), m_rtt.rttvar(), m_rtt.rto(),
+                      m_cc->window());
+    cerr << "Send complete, " << m_progress.acked << " messages ACK'd with "
+         << m_progress.resent << " resends\n";
+    return m_progress.allAcked;
+}
 
-    cerr << "---- sending " << messages.size() << " messages ----" << endl;
+void Messenger::onReadable() {
+    char *bufs[MAX_BURST];
+    ssize_t lens[MAX_BURST];
+    for (int i = 0; i < MAX_BURST; i++) bufs[i] = (char *)&m_inbox[i];
+    int nread = m_sock->readMany(bufs, MAX_DATAGRAM_SIZE, lens, MAX_BURST);
 
-    // Try sending batches until all messages are ACK'd or network failure
-    // TODO: could also try making this smarter, maybe we detect a stall
-    // mathematically
-    for (int send_fails = 0; send_fails < MAX_RESEND_ATTEMPTS;) {
-        // all messages were ACK'd!
-        if (m_seqmap.size() == 0) {
+    clock::time_point now = clock::now();
+    unordered_set<fid_t> &failed = *m_progress.failed;
+    for (int i = 0; i < nread; i++) {
+        Packet &p = m_inbox[i].packet;
+        if (lens[i] != p.hdr.len) {
             c150debug->printf(C150APPLICATION,
-                              "Completed send of %d messages\n",
-                              messages.size());
-            return true;
-        }
-
-        // Send all un-ACK'd messages
-        int throttle = 0;
-        for (auto &kv_pair : m_seqmap) {
-            Packet *p = kv_pair.second;
-            m_sock->write((const char *)p, p->hdr.len);
-            // c150debug->printf(C150APPLICATION, "Sent packet!\n%s\n",
-            //                   p->toString().c_str());
-            if (++throttle == MAX_SEND_GROUP)
-                break;  // don't send too many at a time
-        }
-
-        c150debug->printf(C150APPLICATION, "Sent %d un-ACK'd messages\n",
-                          m_seqmap.size());
-
-        // Read loop - wait for ACKs and remove from resend queue
-        int num_acked = 0;
-        while (true) {
-            Packet p;
-            ssize_t len = m_sock->read((char *)&p, MAX_PACKET_SIZE);
-            if (m_sock->timedout()) break;
-            if (len != p.hdr.len) {
-                c150debug->printf(
-                    C150APPLICATION,
-                    "Received a packet with length %lu but expected "
-                    "length was %d\n",
-                    len, p.hdr.len);
-                continue;
-            }
+                              "Received a packet with length %lu but expected "
+                              "length was %d\n",
+                              lens[i], p.hdr.len);
+            continue;
+        }
 
-            // Inspect packet
-            if (p.hdr.seqno < minseq) continue;
-            if (p.hdr.type == ACK) {
-                if (m_seqmap.find(p.hdr.seqno) == m_seqmap.end()) continue;
-                m_seqmap.erase(p.hdr.seqno);
-                num_acked++;
-            } else if (p.hdr.type == SOS)  // Something went wrong
-                return false;
+        // Inspect packet
+        if (p.hdr.type == SACK) {
+            m_progress.acked += processSack(p, now, &m_progress.resent);
+            continue;
         }
+        // parked messages may be from any earlier send
+        auto parked = m_parked.find(p.hdr.seqno);
+        if (parked != m_parked.end()) {
+            answerParked(parked, p, now);
+            continue;
+        }
+        if (p.hdr.seqno < m_progress.minseq) continue;
+        if (p.hdr.type == ACK) {
+            if (!m_inflight.find(p.hdr.seqno)) continue;
+            m_progress.acked +=
+                acknowledge(vector<seq_t>(1, p.hdr.seqno), now);
+        } else if (p.hdr.type == MISSING_PARTS) {  // an ACK with news
+            Outstanding *out = m_inflight.find(p.hdr.seqno);
+            if (!out) continue;
+            if (out->msg.packet) *out->msg.packet = p;
+            m_progress.acked +=
+                acknowledge(vector<seq_t>(1, p.hdr.seqno), now);
+        } else if (p.hdr.type == PENDING) {  // got there, answer takes long
+            Outstanding *out = m_inflight.find(p.hdr.seqno);
+            if (!out) continue;
+            park(p.hdr.seqno, *out, now);
+        } else if (p.hdr.type == SOS) {  // Something went wrong
+            if (failed.count(p.hdr.fid)) continue;
+            c150debug->printf(C150APPLICATION,
+                              "Got SOS for file %d, seqno %d\n", p.hdr.fid,
+                              p.hdr.seqno);
+            failed.insert(p.hdr.fid);
+            abandonFile(p.hdr.fid);
+            m_progress.allAcked = false;
+        }
+    }
+}
+
+void Messenger::abandonFile(fid_t fid) {
+    m_inflight.forEach([this, fid](seq_t seqno, Outstanding &out) {
+        if (out.msg.head.hdr.fid != fid) return;
+        m_loop->cancel(out.timer);
+        m_inflight.erase(seqno);
+    });
+}
 
-        if (num_acked == 0) send_fails++;
+void Messenger::park(seq_t seqno, Outstanding &out, clock::time_point now) {
+    // Only control messages get PENDING. The server is alive and working
+    // on it: no loss, no backoff, and nothing else waits for the answer.
+    assert(out.msg.packet);
+    Parked &parked = m_parked[seqno];
+    parked.packet = *out.msg.packet;
+    parked.polls = 0;
+    parked.timer = m_loop->at(now + chrono::milliseconds(PENDING_POLL),
+                              [this, seqno]() { onPoll(seqno); });
+    m_loop->cancel(out.timer);
+    m_inflight.erase(seqno);
+    c150debug->printf(C150APPLICATION, "Parked pending message %u\n", seqno);
+}
+
+void Messenger::answerParked(map<seq_t, Parked>::iterator it, const Packet &p,
+                             clock::time_point now) {
+    Parked &parked = it->second;
+    seq_t seqno = it->first;
+    if (p.hdr.type == PENDING) {  // still working on it, poll again later
+        parked.polls = 0;
+        m_loop->cancel(parked.timer);
+        parked.timer = m_loop->at(now + chrono::milliseconds(PENDING_POLL),
+                                  [this, seqno]() { onPoll(seqno); });
+        return;
+    }
+    // Only an ACK or SOS naming the seqno settles it, never a SACK: the
+    // server folds old seqnos into its cumulative ACK
+    if (p.hdr.type != ACK && p.hdr.type != SOS) return;
+    m_loop->cancel(parked.timer);
+    m_answered[seqno] = p.hdr.type == ACK;
+    m_parked.erase(it);
+}
 
+void Messenger::onPoll(seq_t seqno) {
+    auto it = m_parked.find(seqno);
+    if (it == m_parked.end()) return;
+    Parked &parked = it->second;
+    if (++parked.polls > MAX_RESEND_ATTEMPTS) {
         c150debug->printf(C150APPLICATION,
-                          "Send round complete, sent %d messages, received %d "
-                          "ACKs, resending %d un-ACK'd messages\n",
-                          throttle, num_acked, m_seqmap.size());
-        cerr << "Send round complete, sent " << throttle << " messages, "
-             << "received " << num_acked << " ACKs, " << m_seqmap.size()
-             << " messages remaining\n";
+                          "Gave up on pending message %u\n", seqno);
+        m_answered[seqno] = false;
+        m_parked.erase(it);
+        return;
     }
+    const char *buf = (const char *)&parked.packet;
+    ssize_t len = parked.packet.hdr.len;
+    m_sock->writeMany(&buf, &len, 1);
+    // Back off while the server doesn't answer, like a resend would
+    int wait = min(PENDING_POLL << min(parked.polls, 6), MAX_RTO);
+    parked.timer = m_loop->at(clock::now() + chrono::milliseconds(wait),
+                              [this, seqno]() { onPoll(seqno); });
+    c150debug->printf(C150APPLICATION, "Polled pending message %u\n", seqno);
+}
 
-    c150debug->printf(C150APPLICATION,
-                      "Failed to send %d messages after %d attempts\n",
-                      messages.size(), MAX_RESEND_ATTEMPTS);
-    return false;
+void Messenger::waitAnswered() {
+    // Nothing of a send to make progress on, only answers to look for
+    unordered_set<fid_t> failed;
+    m_progress = {m_seqno, &failed, 0, 0, true, false};
+    m_loop->watch(m_sock->fd(), [this]() { onReadable(); });
+    while (m_answered.empty() && !m_parked.empty()) m_loop->runOnce(MAX_RTO);
+    m_loop->unwatch(m_sock->fd());
+}
+
+void Messenger::clearInflight() {
+    m_inflight.forEach(
+        [this](seq_t, Outstanding &out) { m_loop->cancel(out.timer); });
+    m_inflight.reset(m_seqno);
+}
+
+void Messenger::transmit(Outstanding &out, clock::time_point now) {
+    const Outgoing &m = out.msg;
+    size_t bytes = m.head.hdr.len;
+    if (m.packet) {
+        bytes = m.packet->hdr.len;
+        m_outPieces.push_back({m.packet, bytes});
+        m_outCounts.push_back(1);
+    } else if (m.head.hdr.type == BLOB_PARITY) {
+        if (m_paritiesUsed == m_parities.size()) m_parities.emplace_back();
+        vector<uint8_t> &buf = m_parities[m_paritiesUsed++];
+        if (buf.size() < m_dgmSize) buf.resize(m_dgmSize);
+        Packet &p = *(Packet *)buf.data();  // m_dgmSize >= sizeof(Packet)
+        p.ofBlobParity(m.head.hdr.fid, m.head.partno, m.data, m.datalen,
+                       sectionDataSize(m_dgmSize));
+        p.hdr.seqno = m.head.hdr.seqno;
+        bytes = p.hdr.len;
+        m_outPieces.push_back({&p, bytes});
+        m_outCounts.push_back(1);
+    } else {
+        m_outHeads.push_back(m.head);
+        m_outPieces.push_back({&m_outHeads.back(), sizeof(SectionHeader)});
+        m_outPieces.push_back({(void *)m.data, m.datalen});
+        m_outCounts.push_back(2);
+    }
+    m_pacer.charge(bytes);
+    if (m.head.hdr.seqno > m_lastSent) m_lastSent = m.head.hdr.seqno;
+    out.sent = now;
+    out.deadline = now + chrono::milliseconds(m_rtt.rto());
+    out.attempts++;
+
+    seq_t seqno = m.head.hdr.seqno;
+    m_loop->cancel(out.timer);
+    out.timer = m_loop->at(out.deadline, [this, seqno]() { onExpired(seqno); });
+}
+
+void Messenger::flushOutbox() {
+    m_sock->writeMany(m_outPieces.data(), m_outCounts.data(),
+                      m_outCounts.size());
+    m_outPieces.clear();
+    m_outCounts.clear();
+    m_outHeads.clear();
+    m_paritiesUsed = 0;
+}
+
+void Messenger::onExpired(seq_t seqno) {
+    Outstanding *found = m_inflight.find(seqno);
+    if (!found || m_progress.gaveUp) return;
+    Outstanding &out = *found;
+    out.timer = 0;
+    clock::time_point now = clock::now();
+
+    // parity is only worth something the first time around
+    if (out.msg.head.hdr.type == BLOB_PARITY) {
+        m_inflight.erase(seqno);
+        return;
+    }
+    if (out.attempts > MAX_RESEND_ATTEMPTS) {
+        m_progress.gaveUp = true;
+        return;
+    }
+    // wait for the pacer, still expired
+    if (!m_pacer.ready(now)) {
+        out.timer = m_loop->at(m_pacer.whenReady(now),
+                               [this, seqno]() { onExpired(seqno); });
+        return;
+    }
+    // one backoff for a bunch of packets expiring together, not one per
+    // packet, and none for packets that expired before the last one but had
+    // to wait for the pacer
+    if (out.deadline > m_lastBackoff) {
+        m_rtt.backoff();
+        m_lastBackoff = now;
+    }
+    // and one window cut per window of data
+    if (seqno > m_recover) {
+        m_cc->onTimeout();
+        m_recover = m_lastSent;
+    }
+    transmit(out, now);
+    observeLoss(1, true);
+    m_progress.resent++;
+    c150debug->printf(C150APPLICATION, "Resent expired message %u\n", seqno);
+}
+
+int Messenger::processSack(Packet &sack, clock::time_point now,
+                           int *resent) {
+    seq_t highest = sack.value.sack.cumack;
+    if (sack.value.sack.nranges > 0)
+        highest = sack.value.sack.ranges[sack.value.sack.nranges - 1].last;
+
+    // Early retransmit (RFC 5827): with a tiny window there won't be enough
+    // SACKs to reach the usual threshold, so lower it
+    int threshold = max(1, min(DUP_SACK_THRESHOLD, (int)m_inflight.size() - 1));
+
+    vector<seq_t> acked;
+    m_inflight.forEach([&](seq_t seqno, Outstanding &out) {
+        if (sack.sacks(seqno)) {
+            acked.push_back(seqno);
+            return;
+        }
+        // Messages sent after this one got through, but it didn't. After
+        // enough of that it's surely lost, resend it now (only once, after
+        // that its timeout takes over).
+        if (seqno > highest || out.skipped < 0) return;
+        if (out.msg.head.hdr.type == BLOB_PARITY) return;
+        if (++out.skipped < threshold) return;
+        if (seqno > m_recover) {
+            m_cc->onLoss();
+            m_recover = m_lastSent;
+        }
+        transmit(out, now);
+        observeLoss(1, true);
+        out.skipped = -1;
+        (*resent)++;
+    });
+    return acknowledge(acked, now);
+}
+
+int Messenger::acknowledge(const vector<seq_t> &seqnos, clock::time_point now) {
+    // Sample the RTT only from the most recently sent message, and only if
+    // it was sent once (Karn), otherwise we can't tell which send was ACK'd.
+    double rtt_ms = -1;
+    clock::time_point newest;
+    for (seq_t seqno : seqnos) {
+        Outstanding &out = *m_inflight.find(seqno);
+        m_loop->cancel(out.timer);
+        if (out.attempts == 1 && (rtt_ms < 0 || out.sent > newest)) {
+            newest = out.sent;
+            rtt_ms = chrono::duration<double, milli>(now - out.sent).count();
+        }
+        m_inflight.erase(seqno);
+    }
+    if (seqnos.empty()) return 0;
+
+    if (rtt_ms >= 0) m_rtt.sample(rtt_ms);
+    m_cc->onAck(seqnos.size(), rtt_ms);
+    observeLoss(seqnos.size(), false);
+    return seqnos.size();
+}
+
+size_t Messenger::window() {
+    return min(m_cc->window(), MAX_SEND_WINDOW);
+}
+
+void Messenger::updatePacing() {
+    double rate = m_pacingRate;
+    if (rate <= 0 && m_rtt.srtt() > 0)
+        rate = PACING_GAIN * window() * m_dgmSize / (m_rtt.srtt() / 1000);
+    if (m_maxRate > 0) rate = rate > 0 ? min(rate, m_maxRate) : m_maxRate;
+    m_pacer.setRate(rate);
+}
+
+int Messenger::fecGroup() {
+    if (!m_fec || m_lossRate < FEC_MIN_LOSS) return 0;
+    // Parity hides the losses it repairs, so this settles where the losses
+    // parity can't repair keep the groups from growing further
+    int group = FEC_GROUP_LOSSES / m_lossRate;
+    return max(MIN_FEC_GROUP, min(MAX_FEC_GROUP, group));
+}
+
+void Messenger::observeLoss(int n, bool lost) {
+    for (int i = 0; i < n; i++)
+        m_lossRate += FEC_LOSS_GAIN * ((lost ? 1 : 0) - m_lossRate);
 }
 
 bool Messenger::sendBlob(string blob, int blobid, string blobName) {
-    vector<Packet> sectionMessages = partitionBlob(blob, blobid);
-    Packet prepMessage =
-        Packet().ofPrepareForBlob(blobid, blobName, sectionMessages.size());
-    return (send_one(prepMessage) && send(sectionMessages));
+    unordered_set<fid_t> failed;
+    Blob b = {blobid, blobName, (const uint8_t *)blob.data(), blob.size(),
+              false};
+    return sendBlobs(vector<Blob>(1, b), failed);
+}
+
+bool Messenger::sendBlobs(const vector<Blob> &blobs,
+                          unordered_set<fid_t> &failed) {
+    size_t secsize = sectionDataSize(m_dgmSize);
+    vector<Packet> prepMessages;
+    for (const Blob &b : blobs) {
+        uint32_t nparts = (b.len + secsize - 1) / secsize;
+        if (b.resume)
+            prepMessages.push_back(
+                Packet().ofResumeBlob(b.id, b.name, nparts, secsize));
+        else
+            prepMessages.push_back(
+                Packet().ofPrepareForBlob(b.id, b.name, nparts, secsize));
+    }
+
+    // Sections of a blob the server wasn't prepared for would only get SOS,
+    // run() skips the blobs in failed
+    bool prepared = send(prepMessages, failed);
+
+    // A resumed blob only needs the sections the server says it's missing.
+    // A lost answer gets the RESUME resent, so there is one unless the
+    // server folded the RESUME into its cumulative ACK. Then send them all.
+    vector<vector<PartRange>> parts(blobs.size());
+    for (size_t i = 0; i < blobs.size(); i++) {
+        Packet &reply = prepMessages[i];
+        if (reply.hdr.type == MISSING_PARTS) {
+            MissingParts &m = reply.value.missing;
+            parts[i].assign(m.ranges, m.ranges + m.nranges);
+        } else if (blobs[i].len > 0) {
+            parts[i].push_back({0, (uint32_t)((blobs[i].len - 1) / secsize)});
+        }
+    }
+
+    SectionSource sections(blobs, parts, this);
+    bool sent = run(sections, failed);
+    return prepared && sent;
 }
 
-vector<Packet> Messenger::partitionBlob(string blob, int blobid) {
+Messenger::Awaiter Messenger::sendAsync(const Packet &message) {
+    AsyncOp op;
+    op.isBlob = false;
+    op.packet = message;
+    op.ok = false;
+    return Awaiter(this, op);
+}
+
+Messenger::Awaiter Messenger::sendBlobAsync(const Blob &blob) {
+    AsyncOp op;
+    op.isBlob = true;
+    op.blob = blob;
+    op.ok = false;
+    return Awaiter(this, op);
+}
+
+Messenger::Awaiter Messenger::checkAsync(
+    fid_t id, string filename, unsigned char checksum[SHA_DIGEST_LENGTH]) {
+    return sendAsync(Packet().ofCheckIsNecessary(id, filename, checksum));
+}
+
+void Messenger::flushAsync(Scheduler &sched) {
+    // Calls made while we send wait for the next flush
+    vector<AsyncOp *> ops;
+    ops.swap(m_queued);
+
+    // Each coroutine has at most one call queued, so its file id tells
+    // whose message failed
     vector<Packet> messages;
-    size_t pos = 0;
-    uint32_t partno = 0;
+    vector<Blob> blobs;
+    for (AsyncOp *op : ops) {
+        if (op->isBlob)
+            blobs.push_back(op->blob);
+        else
+            messages.push_back(op->packet);
+    }
+    unordered_set<fid_t> failed;
+    if (!messages.empty()) {
+        PacketSource source(messages);
+        run(source, failed);
+    }
+    if (!blobs.empty()) sendBlobs(blobs, failed);
 
-    Packet m;
-    while (pos < blob.size()) {
-        string data_string = blob.substr(pos, sizeof(m.value.section.data));
-        // c150debug->printf(C150APPLICATION,
-        //                   "partitioning id %i partno %i of length %u\n",
-        //                   blobid, partno, data_string.length());
-        pos += data_string.length();
-        m.ofBlobSection(blobid, partno++, data_string.length(),
-                        (uint8_t *)data_string.c_str());
-        messages.push_back(m);
+    // A message answered PENDING is out of the window, and its call waits
+    // for the answer without holding up anybody else's
+    size_t next = 0;  // the call's message
+    int woken = 0;
+    for (AsyncOp *op : ops) {
+        fid_t fid = op->isBlob ? op->blob.id : op->packet.hdr.fid;
+        if (!op->isBlob) {
+            seq_t seqno = messages[next++].hdr.seqno;
+            if (!failed.count(fid) &&
+                (m_parked.count(seqno) || m_answered.count(seqno))) {
+                m_waiting[seqno] = op;
+                continue;
+            }
+        }
+        op->ok = !failed.count(fid);
+        sched.wake(op->waiter);
+        woken++;
     }
 
-    c150debug->printf(C150APPLICATION,
-                      "finished partitioning into %u messages\n",
-                      messages.size());
+    // Nobody can go on until a PENDING message is answered
+    if (woken == 0 && m_answered.empty() && !m_waiting.empty())
+        waitAnswered();
 
-    return messages;
+    for (auto it = m_answered.begin(); it != m_answered.end();) {
+        auto waiting = m_waiting.find(it->first);
+        if (waiting == m_waiting.end()) {
+            ++it;
+            continue;
+        }
+        waiting->second->ok = it->second;
+        sched.wake(waiting->second->waiter);
+        m_waiting.erase(waiting);
+        it = m_answered.erase(it);
+    }
 }
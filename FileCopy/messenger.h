@@ -1,45 +1,331 @@
 #ifndef MESSENGER_H
 #define MESSENGER_H
 
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <map>
 #include <string>
-#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
-#include "c150dgmsocket.h"
 #include "c150grading.h"
-#include "c150nastydgmsocket.h"
+#include "congestion.h"
+#include "eventloop.h"
+#include "pacer.h"
 #include "packet.h"
+#include "rtt.h"
+#include "scheduler.h"
+#include "sendwindow.h"
 #include "settings.h"
+#include "udpsocket.h"
 
 class Messenger {
    public:
-    Messenger(C150NETWORK::C150DgmSocket *sock);
+    // Waits on sock with loop, or with a loop of its own if none is given
+    Messenger(UdpSocket *sock, EventLoop *loop = nullptr);
     ~Messenger();
 
-    // Sends a message and makes sure it is acknowledged.
-    // Returns true if successful, aborts and returns false if SOS (TODO: make
-    // sure this is what we want).
+    // A file's contents, to be sent as a blob
+    struct Blob {
+        fid_t id;
+        std::string name;
+        const uint8_t *data;
+        size_t len;
+        bool resume;  // only send what the server doesn't have yet
+    };
+
+    // Sends messages in one window, like send(messages, failed) below but
+    // with nothing told about which failed. Returns true if every message
+    // was acknowledged, false if one got an SOS (its file's other messages
+    // are dropped, the rest still go) or the network gave up.
+    // send_one sends a copy of message, so an answer isn't copied back.
     bool send_one(Packet &message);
     bool send(vector<Packet> &messages);
 
+    // Sends messages for many files in one window. An SOS only fails the
+    // file it is about: the rest of that file's messages are dropped and its
+    // id is added to failed, while the other files carry on. If the network
+    // gives up, every file with un-ACK'd messages is added to failed.
+    //
+    // An answer that carries more than an ACK (MISSING_PARTS) is copied over
+    // the message it answers. Messages answered PENDING are waited for
+    // after the rest are done.
+    //
+    // Returns true if every message was acknowledged.
+    bool send(vector<Packet> &messages, unordered_set<fid_t> &failed);
+
     // 1. Creates and sends client Message of PREPARE_FOR_BLOB and waits
     // until it's acknowledged.
     // 2. Then splits blob into sections and sends them, making sure all are
     // acknowledged
     //
-    // Returns true if successful, aborts and returns false if SOS
-    // (TODO: make sure this is what we want).
+    // Returns true if successful. Returns false if the PREPARE_FOR_BLOB or
+    // any section gets an SOS, which stops the rest of the blob, or if the
+    // network gives up. The server may then have some of the sections, a
+    // Blob with resume set sends only the others.
     bool sendBlob(std::string blob, int blobid, std::string blobName);
 
+    // Same as sendBlob, but for many blobs sharing the window: all their
+    // PREPARE_FOR_BLOBs go out together, then the sections of every blob
+    // that was prepared. Blobs marked resume send a RESUME_BLOB instead, and
+    // then only the sections the server is missing. Ids of blobs that didn't
+    // make it are added to failed. Returns true if every blob got through.
+    bool sendBlobs(const vector<Blob> &blobs, unordered_set<fid_t> &failed);
+
+    // Picks the congestion controller by name (see congestion.h).
+    // Returns false and keeps the current one if the name is unknown.
+    bool setCongestionControl(std::string name);
+
+    // Turns forward error correction for blob sections on or off. When on,
+    // a BLOB_PARITY follows each group of sections, with smaller groups the
+    // more losses we see, so the server can rebuild a lost section without
+    // waiting for it to be resent.
+    void setErrorCorrection(bool on);
+
+    // Sends blob sections in datagrams of size bytes (at most
+    // MAX_DATAGRAM_SIZE), which the server must be able to take.
+    void setDatagramSize(size_t size);
+
+    // Finds the largest datagram size that makes it to the server, and
+    // uses it from now on. Tries each size a few times and settles for
+    // MAX_PACKET_SIZE if none of them get through. Returns the size.
+    //
+    // With size, tries only that one. The server may not take what the
+    // network would carry (e.g. it reads at most MAXDGMSIZE with
+    // nastiness), so a size asked for must be probed all the same.
+    size_t probeDatagramSize(size_t size = 0);
+
+    // Paces datagrams at rate bytes per second, at most burst bytes back to
+    // back. A rate of 0 (the default) paces from the congestion window and
+    // the RTT instead.
+    void setPacing(double rate, double burst);
+
+    // Never sends faster than rate bytes per second on average, whatever the
+    // pacing and congestion control say. 0 (the default) for no cap.
+    void setBandwidthCap(double rate);
+
+   private:
+    // An operation queued by one of the async calls below
+    struct AsyncOp {
+        bool isBlob;
+        Blob blob;      // if isBlob
+        Packet packet;  // if not
+        bool ok;        // the result, once flushAsync() is done with it
+        std::coroutine_handle<> waiter;
+    };
+
+   public:
+    // What the async calls return, for co_await. The coroutine is suspended
+    // until the next flushAsync() and then gets the result of the call.
+    class Awaiter {
+       public:
+        Awaiter(Messenger *owner, AsyncOp op) : m_owner(owner), m_op(op) {}
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(std::coroutine_handle<> h) {
+            m_op.waiter = h;
+            m_owner->m_queued.push_back(&m_op);
+        }
+        bool await_resume() const noexcept { return m_op.ok; }
+
+       private:
+        Messenger *m_owner;
+        AsyncOp m_op;  // lives in the coroutine's frame while it waits
+    };
+
+    // Async versions of send_one() and sendBlob(), plus a CHECK_IS_NECESSARY
+    // for a file, which is true if the server's copy checks out. Coroutines
+    // await them, and the messenger collects the calls of every coroutine
+    // until flushAsync(), so that many coroutines (say, one per file) share
+    // the window without any threads.
+    Awaiter sendAsync(const Packet &message);
+    Awaiter sendBlobAsync(const Blob &blob);
+    Awaiter checkAsync(fid_t id, std::string filename,
+                       unsigned char checksum[SHA_DIGEST_LENGTH]);
+
+    // True if some coroutine is waiting on an async call
+    bool hasQueued() const { return !m_queued.empty(); }
+
+    // Sends everything the async calls queued, control messages first and
+    // then blobs, and wakes the coroutines that made the calls on sched. A
+    // call whose message the server answered PENDING is woken by a later
+    // flush, once the answer is in, while the others carry on. If nothing
+    // else can, this waits for one.
+    void flushAsync(Scheduler &sched);
+
    private:
-    std::vector<Packet> partitionBlob(string blob, int blobid);
+    typedef std::chrono::steady_clock clock;
+
+    // The start of a BLOB_SECTION packet, laid out exactly as in Packet
+    struct SectionHeader {
+        Header hdr;
+        uint32_t partno;
+    };
+
+    // One message to send. Control messages are Packets the caller owns.
+    // Blob sections are never built as Packets: they are a SectionHeader
+    // plus a pointer into the blob, gathered together only when written.
+    // Parities are like sections, but cover the data of a whole group and
+    // are computed when written.
+    struct Outgoing {
+        SectionHeader head;   // head.hdr is valid for every kind
+        Packet *packet;       // nullptr for a blob section or parity
+        const uint8_t *data;  // blob sections and parities only
+        uint32_t datalen;
+    };
+
+    // Hand out the messages of one send, in order (see messenger.cpp)
+    class Source;
+    class PacketSource;   // the Packets of a vector
+    class SectionSource;  // the sections of some blobs, made on demand
+
+    // A message that has been sent at least once and is waiting on an ACK
+    struct Outstanding {
+        Outgoing msg;
+        clock::time_point sent;      // time of the latest transmission
+        clock::time_point deadline;  // resend if still un-ACK'd by then
+        int attempts;                // number of times it was sent
+        int skipped;  // SACKs that ACK'd later messages, -1 once fast resent
+        EventLoop::TimerId timer;    // fires at deadline, 0 if not armed
+    };
+
+    // A control message the server answered PENDING. It is out of the
+    // window, so it holds nothing else up, and is polled on its own timer
+    // until the server answers it with an ACK or SOS.
+    struct Parked {
+        Packet packet;
+        int polls;  // since the last PENDING
+        EventLoop::TimerId timer;
+    };
+
+    // How the send in progress is going, shared with the loop's callbacks
+    struct Progress {
+        seq_t minseq;  // seqno of the first message of the send
+        unordered_set<fid_t> *failed;
+        int acked;
+        int resent;
+        bool allAcked;
+        bool gaveUp;  // some message ran out of attempts
+    };
 
-    std::string read();
+    // The sliding window behind both send()s and sendBlobs(). Messages are
+    // pulled from source, and given seqnos, only as the window has room.
+    bool run(Source &source, unordered_set<fid_t> &failed);
 
-    C150NETWORK::C150DgmSocket *m_sock;
+    // Drops every in-flight message about a file that got an SOS
+    void abandonFile(fid_t fid);
+
+    // Moves an in-flight message the server answered PENDING to m_parked
+    void park(seq_t seqno, Outstanding &out, clock::time_point now);
+
+    // Handles the server's answer to a parked message: another PENDING, or
+    // the real answer, which goes in m_answered
+    void answerParked(std::map<seq_t, Parked>::iterator it, const Packet &p,
+                      clock::time_point now);
+
+    // Called by the loop every PENDING_POLL ms for a parked message: asks
+    // again, or gives up on it if the server has gone quiet
+    void onPoll(seq_t seqno);
+
+    // Waits on the loop until some parked message is answered
+    void waitAnswered();
+
+    // Forgets every in-flight message, and their timers
+    void clearInflight();
+
+    // Queues the packet for writing and (re)arms its resend timer
+    void transmit(Outstanding &out, clock::time_point now);
+
+    // Writes every queued packet with a single system call
+    void flushOutbox();
+
+    // Called by the loop when the socket has responses: reads a burst and
+    // retires, or abandons, the messages they answer
+    void onReadable();
+
+    // Called by the loop at an in-flight message's deadline: resends it,
+    // backing off the retransmission timeout unless that was just done for
+    // an earlier one. Gives up the send if it ran out of attempts.
+    void onExpired(seq_t seqno);
+
+    // Retires every in-flight message the SACK covers, and fast resends
+    // messages it keeps skipping over. Returns the number retired and adds
+    // the number resent to *resent.
+    int processSack(Packet &sack, clock::time_point now, int *resent);
+
+    // Retires ACK'd in-flight messages, sampling the RTT and letting the
+    // congestion controller grow the window. Returns the number retired.
+    int acknowledge(const std::vector<seq_t> &seqnos, clock::time_point now);
+
+    // Number of messages we may have in flight right now
+    size_t window();
+
+    // Sets the pacer's rate from the configured rate, the window and the
+    // RTT, and the cap
+    void updatePacing();
+
+    // Sections per parity for the next group, 0 for no parity
+    int fecGroup();
+
+    // Folds n messages into the running loss rate, lost or not
+    void observeLoss(int n, bool lost);
+
+    UdpSocket *m_sock;
     seq_t m_seqno;
 
-    unordered_map<seq_t, Packet *> m_seqmap;
+    // async calls waiting for flushAsync()
+    std::vector<AsyncOp *> m_queued;
+
+    // messages answered PENDING, by seqno, then their answers (true for
+    // an ACK) until they're collected, and the async calls waiting on them
+    std::map<seq_t, Parked> m_parked;
+    std::map<seq_t, bool> m_answered;
+    std::map<seq_t, AsyncOp *> m_waiting;
+
+    // waits on the socket and the resend deadlines
+    EventLoop *m_loop;
+    bool m_ownLoop;
+    Progress m_progress;
+
+    // messages waiting to be written by flushOutbox(): datagram i is the
+    // next m_outCounts[i] pieces of m_outPieces. Section headers are copied
+    // into m_outHeads (a deque, so the pieces' pointers stay put) because
+    // the message itself may be ACK'd before the flush. Parities are built
+    // in the first m_paritiesUsed buffers of m_parities, kept from flush to
+    // flush and only as big as a datagram.
+    std::vector<struct iovec> m_outPieces;
+    std::vector<int> m_outCounts;
+    std::deque<SectionHeader> m_outHeads;
+    std::vector<std::vector<uint8_t>> m_parities;
+    size_t m_paritiesUsed;
+
+    // where readMany() puts a burst of responses
+    std::vector<PacketBuffer> m_inbox;
+
+    // size of the datagrams carrying blob sections
+    size_t m_dgmSize;
+
+    // the in-flight messages, never more than window() of them, spanning
+    // at most MAX_SEND_WINDOW seqnos
+    SendWindow<Outstanding, MAX_SEND_WINDOW> m_inflight;
+
+    // drives the resend deadlines
+    RttEstimator m_rtt;
+    clock::time_point m_lastBackoff;
+
+    // drives the window size
+    CongestionController *m_cc;
+    seq_t m_lastSent;  // highest seqno sent so far
+    seq_t m_recover;   // losses at or below this were already reacted to
+
+    // spaces out datagrams
+    Pacer m_pacer;
+    double m_pacingRate;  // configured, 0 to follow the window
+    double m_maxRate;     // 0 for no cap
+
+    // drives the parity group size
+    bool m_fec;
+    double m_lossRate;  // fraction of messages that needed a resend
 };
 
 #endif
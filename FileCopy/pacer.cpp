@@ -0,0 +1,45 @@
+#include "pacer.h"
+
+#include <algorithm>
+
+#include "packet.h"
+
+using namespace std;
+
+Pacer::Pacer() {
+    m_rate = 0;
+    m_burst = PACING_BURST * MAX_PACKET_SIZE;
+    m_tokens = m_burst;
+    m_last = clock::now();
+}
+
+void Pacer::setRate(double rate) { m_rate = rate; }
+
+void Pacer::setBurst(double bytes) {
+    m_burst = bytes;
+    m_tokens = min(m_tokens, m_burst);
+}
+
+bool Pacer::ready(clock::time_point now) {
+    if (m_rate <= 0) return true;
+
+    // Timers only fire to within MESSENGER_TICK or so, the bucket must hold
+    // at least that much or the rate would never be reached
+    double depth = max(m_burst, m_rate * MESSENGER_TICK / 1000.0);
+    double elapsed = chrono::duration<double>(now - m_last).count();
+    m_tokens = min(depth, m_tokens + elapsed * m_rate);
+    m_last = now;
+    return m_tokens > 0;
+}
+
+Pacer::clock::time_point Pacer::whenReady(clock::time_point now) {
+    if (ready(now)) return now;
+    // paying off the debt takes -m_tokens / m_rate seconds, and a bit
+    auto wait = chrono::duration<double>(-m_tokens / m_rate);
+    return now + chrono::duration_cast<clock::duration>(wait) +
+           chrono::microseconds(1);
+}
+
+void Pacer::charge(size_t bytes) {
+    if (m_rate > 0) m_tokens -= bytes;
+}
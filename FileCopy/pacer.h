@@ -0,0 +1,44 @@
+#ifndef PACER_H
+#define PACER_H
+
+#include <chrono>
+#include <cstddef>
+
+#include "settings.h"
+
+// Token bucket that spaces out datagrams.
+//
+// The bucket fills at the pacing rate up to the burst size, and every
+// datagram sent takes its bytes out. Sends may overdraw it (a resend that
+// can't wait), the debt is then paid off before anything else goes out.
+class Pacer {
+   public:
+    typedef std::chrono::steady_clock clock;
+
+    Pacer();
+
+    // Bytes per second, 0 for no pacing at all
+    void setRate(double rate);
+
+    // Most bytes that may go out back to back after a quiet spell
+    void setBurst(double bytes);
+
+    double rate() const { return m_rate; }
+
+    // True if the bucket has room for another datagram now
+    bool ready(clock::time_point now);
+
+    // When the bucket will next have room, now if it already has
+    clock::time_point whenReady(clock::time_point now);
+
+    // Takes the bytes of a datagram that was just sent out of the bucket
+    void charge(size_t bytes);
+
+   private:
+    double m_rate;
+    double m_burst;
+    double m_tokens;
+    clock::time_point m_last;  // when the bucket was last filled
+};
+
+#endif
@@ -1,6 +1,8 @@
 #include "packet.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -39,7 +41,8 @@ Packet Packet::ofDeleteIt(int id) {
     return *this;
 }
 
-Packet Packet::ofPrepareForBlob(int id, std::string filename, uint32_t nparts) {
+Packet Packet::ofPrepareForBlob(int id, std::string filename, uint32_t nparts,
+                                uint32_t secsize) {
     hdr.fid = id;
     hdr.type = PREPARE_FOR_BLOB;
     hdr.len = sizeof(hdr) + sizeof(value.prep);
@@ -49,6 +52,14 @@ Packet Packet::ofPrepareForBlob(int id, std::string filename, uint32_t nparts) {
 
     memcpy(value.prep.filename, filename.c_str(), filename.length());
     value.prep.nparts = nparts;
+    value.prep.secsize = secsize;
+    return *this;
+}
+
+Packet Packet::ofResumeBlob(int id, std::string filename, uint32_t nparts,
+                            uint32_t secsize) {
+    ofPrepareForBlob(id, filename, nparts, secsize);
+    hdr.type = RESUME_BLOB;
     return *this;
 }
 
@@ -66,6 +77,33 @@ Packet Packet::ofBlobSection(int id, uint32_t partno, uint32_t size,
     return *this;
 }
 
+Packet Packet::ofBlobParity(int id, uint32_t first, const uint8_t *data,
+                            uint32_t len, uint32_t secsize) {
+    hdr.fid = id;
+    hdr.type = BLOB_PARITY;
+    uint32_t longest = min(len, secsize);
+    hdr.len = sizeof(hdr) + offsetof(BlobParity, data) + longest;
+
+    memset(&value.parity, 0, offsetof(BlobParity, data) + longest);
+    value.parity.first = first;
+    uint8_t *xordata = value.parity.data;  // may run past the Packet
+    for (uint32_t pos = 0; pos < len; pos += secsize) {
+        uint32_t seclen = min(len - pos, secsize);
+        for (uint32_t i = 0; i < seclen; i++) xordata[i] ^= data[pos + i];
+        value.parity.lenxor ^= seclen;
+        value.parity.count++;
+    }
+    return *this;
+}
+
+Packet Packet::ofProbe(uint32_t size) {
+    assert(size >= sizeof(hdr) && size <= MAX_DATAGRAM_SIZE);
+    hdr.len = size;
+    hdr.fid = -1;
+    hdr.type = PROBE;
+    return *this;
+}
+
 /* server side */
 Packet Packet::intoAck() {
     hdr.type = ACK;
@@ -77,8 +115,66 @@ Packet Packet::intoSOS() {
     return *this;
 }
 
+Packet Packet::intoPending() {
+    hdr.type = PENDING;
+    hdr.len = sizeof(Header);
+    return *this;
+}
+
+Packet Packet::intoMissingParts(const PartRange *ranges, uint32_t nranges,
+                                uint32_t nparts) {
+    hdr.type = MISSING_PARTS;
+    if (nranges > MAX_MISSING_RANGES) {
+        // ask for a bit more than needed rather than leave anything out
+        nranges = MAX_MISSING_RANGES;
+        memcpy(value.missing.ranges, ranges, nranges * sizeof(PartRange));
+        value.missing.ranges[nranges - 1].last = nparts - 1;
+    } else {
+        memcpy(value.missing.ranges, ranges, nranges * sizeof(PartRange));
+    }
+    value.missing.nranges = nranges;
+    hdr.len = sizeof(hdr) + sizeof(value.missing.nranges) +
+              nranges * sizeof(PartRange);
+    return *this;
+}
+
+Packet Packet::ofSelectiveAck(seq_t cumack, const SackRange *ranges,
+                              uint32_t nranges) {
+    assert(nranges <= MAX_SACK_RANGES);
+    hdr.fid = -1;
+    hdr.type = SACK;
+    hdr.len = sizeof(hdr) + sizeof(value.sack.cumack) +
+              sizeof(value.sack.nranges) + nranges * sizeof(SackRange);
+
+    value.sack.cumack = cumack;
+    value.sack.nranges = nranges;
+    memcpy(value.sack.ranges, ranges, nranges * sizeof(SackRange));
+    return *this;
+}
+
+bool Packet::sacks(seq_t seqno) {
+    assert(hdr.type == SACK);
+    if (seqno <= value.sack.cumack) return true;
+
+    // binary search the sorted ranges
+    int lo = 0, hi = (int)value.sack.nranges - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        const SackRange &r = value.sack.ranges[mid];
+        if (seqno < r.first)
+            hi = mid - 1;
+        else if (seqno > r.last)
+            lo = mid + 1;
+        else
+            return true;
+    }
+    return false;
+}
+
 int Packet::datalen() {
-    assert(hdr.type == BLOB_SECTION);
+    assert(hdr.type == BLOB_SECTION || hdr.type == BLOB_PARITY);
+    if (hdr.type == BLOB_PARITY)
+        return hdr.len - (sizeof(hdr) + offsetof(BlobParity, data));
     return hdr.len - (sizeof(hdr) + sizeof(value.section.partno));
 }
 
@@ -97,6 +193,20 @@ string Packet::toString() {
             ss << "Type: "
                << "ACK\n";
             break;
+        case PENDING:
+            ss << "Type: "
+               << "Pending\n";
+            break;
+        case SACK:
+            ss << "Type: "
+               << "Selective ACK\n";
+            ss << "Cumulative ACK: " << value.sack.cumack << endl;
+            ss << "Ranges:";
+            for (uint32_t i = 0; i < value.sack.nranges; i++)
+                ss << " " << value.sack.ranges[i].first << "-"
+                   << value.sack.ranges[i].last;
+            ss << endl;
+            break;
         case CHECK_IS_NECESSARY:
             ss << "Type: "
                << "Check is necessary\n";
@@ -127,12 +237,38 @@ string Packet::toString() {
                 ss << value.prep.filename[i];
             ss << endl;
             ss << "Number of parts: " << value.prep.nparts << endl;
+            ss << "Section size: " << value.prep.secsize << endl;
             break;
         case BLOB_SECTION:
             ss << "Type: "
                << "Blob section\n";
             ss << "Section number: " << value.section.partno << endl;
             break;
+        case PROBE:
+            ss << "Type: "
+               << "Probe\n";
+            break;
+        case RESUME_BLOB:
+            ss << "Type: "
+               << "Resume blob\n";
+            ss << "Number of parts: " << value.prep.nparts << endl;
+            ss << "Section size: " << value.prep.secsize << endl;
+            break;
+        case MISSING_PARTS:
+            ss << "Type: "
+               << "Missing parts\n";
+            ss << "Ranges:";
+            for (uint32_t i = 0; i < value.missing.nranges; i++)
+                ss << " " << value.missing.ranges[i].first << "-"
+                   << value.missing.ranges[i].last;
+            ss << endl;
+            break;
+        case BLOB_PARITY:
+            ss << "Type: "
+               << "Blob parity\n";
+            ss << "Sections: " << value.parity.first << "-"
+               << value.parity.first + value.parity.count - 1 << endl;
+            break;
     }
     ss << "---------------\n";
     return ss.str();
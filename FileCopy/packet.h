@@ -19,11 +19,18 @@ enum MessageType {
     // For now no funny business, just used as normal enum.
     SOS                = 0b10000000, 
     ACK                = 0b01000000,
+    SACK               = 0b00100000,
     CHECK_IS_NECESSARY = 0b00000001, 
     KEEP_IT            = 0b00000010,
     DELETE_IT          = 0b00000100,
     PREPARE_FOR_BLOB   = 0b00001000,
     BLOB_SECTION       = 0b00010000,
+    BLOB_PARITY        = 0b100000000,
+    PROBE              = 0b1000000000,
+    RESUME_BLOB        = 0b10000000000,
+    MISSING_PARTS      = 0b100000000000,
+    // got it, but the answer takes a while: ask again later
+    PENDING            = 0b1000000000000,
 };
 // clang-format on
 
@@ -35,9 +42,30 @@ struct Header {
     fid_t fid;
 };
 
+// Datagrams are MAX_PACKET_SIZE unless client and server agree on a bigger
+// size, never more than MAX_DATAGRAM_SIZE. Only sections and parities grow.
 const int MAX_PACKET_SIZE = C150NETWORK::MAXDGMSIZE;
+const int MAX_DATAGRAM_SIZE = 65507;  // the most UDP carries over IPv4
 const int MAX_PAYLOAD_SIZE = C150NETWORK::MAXDGMSIZE - sizeof(Header);
 
+// Inclusive range of acknowledged seqnos
+struct SackRange {
+    seq_t first;
+    seq_t last;
+};
+
+const int MAX_SACK_RANGES =
+    (MAX_PAYLOAD_SIZE - sizeof(seq_t) - sizeof(uint32_t)) / sizeof(SackRange);
+
+// Acknowledges many messages at once: everything up to and including
+// cumack, plus every seqno in ranges. Ranges are sorted, disjoint, and lie
+// above cumack + 1, so gaps between them are messages the server is missing.
+struct SelectiveAck {
+    seq_t cumack;
+    uint32_t nranges;
+    SackRange ranges[MAX_SACK_RANGES];
+};
+
 struct CheckIsNecessary {
     unsigned char checksum[SHA_DIGEST_LENGTH];
     char filename[MAX_FILENAME_LENGTH];
@@ -46,17 +74,55 @@ struct CheckIsNecessary {
 struct PrepareForBlob {
     char filename[MAX_FILENAME_LENGTH];
     uint32_t nparts;
+    uint32_t secsize;  // bytes of data in every section but the last
+};
+
+// Inclusive range of section numbers
+struct PartRange {
+    uint32_t first;
+    uint32_t last;
+};
+
+const int MAX_MISSING_RANGES =
+    (MAX_PAYLOAD_SIZE - sizeof(uint32_t)) / sizeof(PartRange);
+
+// The server's answer to a RESUME_BLOB: the sections it still needs. If they
+// don't fit, the last range runs to the end of the blob.
+struct MissingParts {
+    uint32_t nranges;
+    PartRange ranges[MAX_MISSING_RANGES];
 };
 
+// Bytes of data in a section for a given datagram size, leaving room for a
+// BlobParity header too so parity covers whole sections
+inline size_t sectionDataSize(size_t dgmsize) {
+    return dgmsize - sizeof(Header) - 2 * sizeof(uint32_t);
+}
+const int MAX_SECTION_DATA = MAX_PAYLOAD_SIZE - 2 * sizeof(uint32_t);
+
 struct BlobSection {
     uint32_t partno;
-    uint8_t data[MAX_PAYLOAD_SIZE - sizeof(partno)];
+    uint8_t data[MAX_SECTION_DATA];
+};
+
+// XOR of the sections first .. first + count - 1 of a blob, each padded with
+// zeros to the longest. The server can rebuild any one of them that goes
+// missing from the others. Its seqno directly follows theirs, which are
+// consecutive, so the server can tell which seqno it rebuilt.
+struct BlobParity {
+    uint32_t first;
+    uint16_t count;
+    uint16_t lenxor;  // XOR of the sections' lengths
+    uint8_t data[MAX_SECTION_DATA];
 };
 
 union Payload {
+    SelectiveAck sack;
     CheckIsNecessary check;
     PrepareForBlob prep;
+    MissingParts missing;
     BlobSection section;
+    BlobParity parity;
 };
 
 struct Packet {
@@ -70,14 +136,35 @@ struct Packet {
                               unsigned char checksum[SHA_DIGEST_LENGTH]);
     Packet ofKeepIt(int id);
     Packet ofDeleteIt(int id);
-    Packet ofPrepareForBlob(int id, std::string filename, uint32_t nparts);
+    Packet ofPrepareForBlob(int id, std::string filename, uint32_t nparts,
+                            uint32_t secsize);
+    // like PREPARE_FOR_BLOB, but keeps whatever sections the server has
+    Packet ofResumeBlob(int id, std::string filename, uint32_t nparts,
+                        uint32_t secsize);
     Packet ofBlobSection(int id, uint32_t partno, uint32_t size,
                          const uint8_t *data);
+    // parity for the sections of the len bytes at data, which start with
+    // section first and are secsize bytes each. Bigger than a Packet if
+    // secsize is, so build it in place in a PacketBuffer.
+    Packet ofBlobParity(int id, uint32_t first, const uint8_t *data,
+                        uint32_t len, uint32_t secsize);
+    // asks the server whether a datagram of size bytes gets through,
+    // padding is left to the caller (see PacketBuffer)
+    Packet ofProbe(uint32_t size);
     /* server side */
     Packet intoAck();
     Packet intoSOS();
+    Packet intoPending();
+    // answers a RESUME_BLOB, for a blob of nparts sections
+    Packet intoMissingParts(const PartRange *ranges, uint32_t nranges,
+                            uint32_t nparts);
+    Packet ofSelectiveAck(seq_t cumack, const SackRange *ranges,
+                          uint32_t nranges);
+
+    // true if seqno is covered by this SACK
+    bool sacks(seq_t seqno);
 
-    /* */
+    // length of the data in a BLOB_SECTION or BLOB_PARITY
     int datalen();
 
     // for debugging
@@ -86,4 +173,12 @@ struct Packet {
 
 typedef Packet Message;
 
+// Room for the largest datagram we may read or build. Sections and parities
+// in datagrams bigger than MAX_PACKET_SIZE run on past the end of Packet.
+union PacketBuffer {
+    Packet packet;
+    uint8_t bytes[MAX_DATAGRAM_SIZE];
+    PacketBuffer() : packet() {}
+};
+
 #endif
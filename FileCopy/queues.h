@@ -0,0 +1,90 @@
+#ifndef QUEUES_H
+#define QUEUES_H
+
+#include <atomic>
+#include <cstddef>
+
+// Lock-free queues for handing work between threads. Neither ever blocks:
+// waiting for something to arrive is up to the caller (see diskpool.h).
+
+// Bounded queue with one producer thread and one consumer thread. N must be
+// a power of two.
+template <typename T, size_t N>
+class SpscQueue {
+    static_assert(N > 0 && (N & (N - 1)) == 0, "N must be a power of two");
+
+   public:
+    SpscQueue() : m_head(0), m_tail(0) {}
+
+    // Producer only. False if the queue is full.
+    bool push(const T &item) {
+        size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head.load(std::memory_order_acquire) == N) return false;
+        m_items[tail & (N - 1)] = item;
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. False if the queue is empty.
+    bool pop(T &item) {
+        size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail.load(std::memory_order_acquire)) return false;
+        item = m_items[head & (N - 1)];
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+   private:
+    T m_items[N];
+    // on their own cache lines, each is written by one side only
+    alignas(64) std::atomic<size_t> m_head;  // next to pop
+    alignas(64) std::atomic<size_t> m_tail;  // next to push
+};
+
+// Unbounded queue with any number of producer threads and one consumer
+// thread (Vyukov's intrusive MPSC queue). T links itself in through a
+// std::atomic<T *> next member, so pushing never allocates.
+template <typename T>
+class MpscQueue {
+   public:
+    MpscQueue() : m_head(&m_stub), m_tail(&m_stub) {
+        m_stub.next.store(nullptr, std::memory_order_relaxed);
+    }
+
+    // Any thread
+    void push(T *item) {
+        item->next.store(nullptr, std::memory_order_relaxed);
+        T *prev = m_head.exchange(item, std::memory_order_acq_rel);
+        prev->next.store(item, std::memory_order_release);
+    }
+
+    // Consumer only. nullptr if the queue is empty, or if the only item is
+    // still being pushed (it will be there for the next pop).
+    T *pop() {
+        T *tail = m_tail;
+        T *next = tail->next.load(std::memory_order_acquire);
+        if (tail == &m_stub) {
+            if (!next) return nullptr;
+            m_tail = tail = next;
+            next = next->next.load(std::memory_order_acquire);
+        }
+        if (next) {
+            m_tail = next;
+            return tail;
+        }
+        if (tail != m_head.load(std::memory_order_acquire)) return nullptr;
+        // tail is the last item, put the stub behind it so it can go
+        push(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if (!next) return nullptr;
+        m_tail = next;
+        return tail;
+    }
+
+   private:
+    std::atomic<T *> m_head;  // last pushed
+    T *m_tail;                // next to pop
+    T m_stub;
+};
+
+#endif
@@ -0,0 +1,37 @@
+#include "reassembly.h"
+
+using namespace std;
+
+Reassembly::Reassembly(uint32_t nparts) {
+    m_nparts = nparts;
+    reset();
+}
+
+void Reassembly::reset() {
+    m_bits.assign((m_nparts + 63) / 64, 0);
+    m_remaining = m_nparts;
+    m_gaps.clear();
+    if (m_nparts > 0) m_gaps[0] = m_nparts - 1;
+}
+
+bool Reassembly::mark(uint32_t partno) {
+    if (partno >= m_nparts || has(partno)) return false;
+    m_bits[partno / 64] |= 1ull << (partno % 64);
+    m_remaining--;
+
+    // Split the gap it was in
+    auto it = --m_gaps.upper_bound(partno);
+    uint32_t first = it->first, last = it->second;
+    m_gaps.erase(it);
+    if (first < partno) m_gaps[first] = partno - 1;
+    if (partno < last) m_gaps[partno + 1] = last;
+    return true;
+}
+
+void Reassembly::missing(vector<PartRange> &out, size_t max) const {
+    out.clear();
+    for (auto &gap : m_gaps) {
+        if (out.size() == max) break;
+        out.push_back({gap.first, gap.second});
+    }
+}
@@ -0,0 +1,49 @@
+#ifndef REASSEMBLY_H
+#define REASSEMBLY_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include "packet.h"
+
+// Which sections of a file have arrived.
+//
+// A bit per section answers "have we got it?", a count of the missing ones
+// answers "are we done?", and an index of the ranges still missing answers
+// "what do we need?" (the MISSING_PARTS answer to a RESUME_BLOB), each
+// without walking every section.
+class Reassembly {
+   public:
+    Reassembly() : Reassembly(0) {}
+
+    // Expects nparts sections, none arrived yet
+    explicit Reassembly(uint32_t nparts);
+
+    uint32_t size() const { return m_nparts; }
+    uint32_t remaining() const { return m_remaining; }
+    bool complete() const { return m_remaining == 0; }
+
+    bool has(uint32_t partno) const {
+        return partno < m_nparts && (m_bits[partno / 64] >> (partno % 64)) & 1;
+    }
+
+    // Records that partno arrived. False if it already had, or is out of
+    // range.
+    bool mark(uint32_t partno);
+
+    // Forgets every section that arrived
+    void reset();
+
+    // Fills out with the missing sections as inclusive ranges, lowest
+    // first, at most max of them
+    void missing(std::vector<PartRange> &out, size_t max) const;
+
+   private:
+    std::vector<uint64_t> m_bits;
+    uint32_t m_nparts;
+    uint32_t m_remaining;
+    std::map<uint32_t, uint32_t> m_gaps;  // first -> last, missing ranges
+};
+
+#endif
@@ -1,6 +1,16 @@
 #include "responder.h"
 
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "acktracker.h"
 #include "c150debug.h"
+#include "eventloop.h"
 
 using namespace std;
 using namespace C150NETWORK;
@@ -8,11 +18,14 @@ using namespace C150NETWORK;
 ServerResponder::ServerResponder(Filecache *cache) { m_cache = cache; }
 
 // modifies packet in place
-void ServerResponder::bounce(Packet *p) {
+bool ServerResponder::bounce(Packet *p, seq_t *recovered) {
     seq_t seqno = p->hdr.seqno;
     const CheckIsNecessary *check;
     const PrepareForBlob *prep;
     BlobSection *section;
+    vector<PartRange> missing;
+
+    *recovered = -1;
 
     bool shouldAck = false;  // defaults always to SOS
 
@@ -21,6 +34,8 @@ void ServerResponder::bounce(Packet *p) {
             shouldAck = false;
             break;
         case ACK:
+        case SACK:
+        case PROBE:  // it got here, that's all it wanted to know
             shouldAck = true;
             break;
         case KEEP_IT:
@@ -31,19 +46,43 @@ void ServerResponder::bounce(Packet *p) {
             break;
         case CHECK_IS_NECESSARY:
             check = &(p->value.check);
+            if (m_cache->checkPending(p->hdr.fid, seqno, check->filename,
+                                      check->checksum))
+                return false;
             shouldAck = m_cache->idempotentCheckfile(
                 p->hdr.fid, seqno, check->filename, check->checksum);
             break;
         case PREPARE_FOR_BLOB:
             prep = &(p->value.prep);
             shouldAck = m_cache->idempotentPrepareForFile(
-                p->hdr.fid, seqno, prep->filename, prep->nparts);
+                p->hdr.fid, seqno, prep->filename, prep->nparts,
+                prep->secsize);
+            break;
+        case RESUME_BLOB:
+            prep = &(p->value.prep);
+            shouldAck = m_cache->idempotentResumeFile(
+                p->hdr.fid, seqno, prep->filename, prep->nparts,
+                prep->secsize, missing);
+            if (shouldAck) {
+                // the answer is what the client needs, not just an ACK
+                p->intoMissingParts(missing.data(), missing.size(),
+                                    prep->nparts);
+                return true;
+            }
+            break;
+        case MISSING_PARTS:
+        case PENDING:
+            shouldAck = false;
             break;
         case BLOB_SECTION:
             section = &(p->value.section);
             shouldAck = m_cache->idempotentStoreFileChunk(
                 p->hdr.fid, seqno, section->partno, section->data,
-                p->datalen());
+                p->datalen(), recovered);
+            break;
+        case BLOB_PARITY:
+            shouldAck = m_cache->idempotentStoreParity(
+                p->hdr.fid, seqno, &p->value.parity, p->datalen(), recovered);
             break;
     }
     c150debug->printf(C150APPLICATION, "Going to %s!\n",
@@ -51,31 +90,191 @@ void ServerResponder::bounce(Packet *p) {
 
     // pretty simple, modify incoming packet hdr in place
     p->hdr.type = shouldAck ? ACK : SOS;
+    return true;
 }
 
-// For the time being, the listener responds to every packet.
-// Anything else is an optimization that shouldn't be made prematurely.
-void listen(C150DgmSocket *sock, C150NastyFile *nfp, string dir) {
-    Filecache cache = Filecache(dir, nfp);
-    ServerResponder responder = ServerResponder(&cache);
+// Everything the server knows about one client. Clients number their files
+// and messages independently, so none of it can be shared.
+struct Client {
+    Filecache cache;
+    ServerResponder responder;
+    AckTracker acks;
+    struct sockaddr_in addr;
+    vector<Packet> parked;  // CHECKs waiting on the disk workers
+    EventLoop::clock::time_point lastHeard;
+    Client(string dir, C150NastyFile *nfp, DiskPool *disk,
+           const struct sockaddr_in &from)
+        : cache(dir, nfp, disk), responder(&cache), addr(from) {}
+};
 
-    Packet p;
-    while (true) {
-        unsigned long len = sock->read((char *)&p, sizeof(Packet));
-        if (len != p.hdr.len) {
-            c150debug->printf(C150APPLICATION,
-                              "Received a packet with length %lu but expected "
-                              "length was %d\n",
-                              len, p.hdr.len);
-            continue;
-        }
+// Clients are told apart by address and port
+static uint64_t clientKey(const struct sockaddr_in &addr) {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+// Bounces packets from one client and answers them with a single batch of
+// writes: an SOS for each failure (and the MISSING_PARTS answer to each
+// RESUME_BLOB), and one SACK covering every ACK (or one per SACK_EVERY
+// ACKs, for very long bursts). Packets that can't be answered yet get a
+// PENDING, and are parked with the client until they can.
+//
+// CHECK_IS_NECESSARY is always answered with an ACK or SOS of its own, never
+// in a SACK: the client takes a PENDING message out of its window, and only
+// an answer naming its seqno settles it.
+static void respond(UdpSocket *sock, Client &client, Packet *packets[],
+                    int n) {
+    AckTracker &acks = client.acks;
+    vector<const char *> outBufs;
+    vector<ssize_t> outLens;
+    vector<Packet> sacks;
+    sacks.reserve(n / SACK_EVERY + 1);  // no reallocation below
 
+    for (int i = 0; i < n; i++) {
+        Packet &p = *packets[i];
         c150debug->printf(C150APPLICATION, "Read a packet!\n%s",
                           p.toString().c_str());
         // modify in place
-        responder.bounce(&p);
-        sock->write((const char *)&p, p.hdr.len);
-        c150debug->printf(C150APPLICATION, "Responded!\n%s",
-                          p.toString().c_str());
+        seq_t recovered;
+        bool check = p.hdr.type == CHECK_IS_NECESSARY;
+        if (!client.responder.bounce(&p, &recovered)) {
+            c150debug->printf(C150APPLICATION,
+                              "Holding on to seqno %d until disk work on "
+                              "file %d is done\n",
+                              p.hdr.seqno, p.hdr.fid);
+            // the client asks again until it's answered, park it once
+            bool parked = false;
+            for (Packet &q : client.parked)
+                parked = parked || q.hdr.seqno == p.hdr.seqno;
+            if (!parked) client.parked.push_back(p);
+            p.intoPending();
+        }
+        if (recovered >= 0) acks.ack(recovered);
+        if (check || p.hdr.type == SOS || p.hdr.type == MISSING_PARTS ||
+            p.hdr.type == PENDING) {
+            // answered with a packet of its own, not in the SACK
+            acks.sos(p.hdr.seqno);
+            outBufs.push_back((const char *)&p);
+            outLens.push_back(p.hdr.len);
+        } else {
+            acks.ack(p.hdr.seqno);
+        }
+
+        if (acks.pending() >= SACK_EVERY) {
+            sacks.push_back(acks.toSack());
+            outBufs.push_back((const char *)&sacks.back());
+            outLens.push_back(sacks.back().hdr.len);
+        }
+    }
+    if (acks.pending() > 0) {
+        sacks.push_back(acks.toSack());
+        outBufs.push_back((const char *)&sacks.back());
+        outLens.push_back(sacks.back().hdr.len);
     }
+
+    sock->writeMany(outBufs.data(), outLens.data(), outBufs.size(),
+                    &client.addr);
+    c150debug->printf(C150APPLICATION, "Responded with %d packets\n",
+                      outBufs.size());
+}
+
+// The listener answers every packet, but not with a packet each. It reads
+// whatever burst of packets has arrived and answers each client in the
+// burst with one batch of writes (see respond()). Completed files are
+// written and checked by the disk workers meanwhile, and the CHECKs that had
+// to wait for them are answered as they finish. Clients that have gone
+// quiet are forgotten after CLIENT_IDLE_TIMEOUT.
+void listen(UdpSocket *sock, C150NastyFile *nfp, DiskPool *disk,
+            string dir) {
+    unordered_map<uint64_t, unique_ptr<Client>> clients;
+
+    // clients may send datagrams up to the limit, see PROBE
+    sock->sizeBuffers(MAX_DATAGRAM_SIZE);
+    vector<PacketBuffer> burst(MAX_BURST);
+    char *bufs[MAX_BURST];
+    ssize_t lens[MAX_BURST];
+    struct sockaddr_in senders[MAX_BURST];
+    Packet *packets[MAX_BURST];
+    for (int i = 0; i < MAX_BURST; i++) bufs[i] = (char *)&burst[i];
+
+    auto onReadable = [&]() {
+        int nread = sock->readMany(bufs, MAX_DATAGRAM_SIZE, lens, MAX_BURST,
+                                   senders);
+
+        // Each run of packets from the same client is answered together
+        for (int start = 0, end; start < nread; start = end) {
+            const struct sockaddr_in &from = senders[start];
+            uint64_t key = clientKey(from);
+            for (end = start + 1;
+                 end < nread && clientKey(senders[end]) == key; end++)
+                ;
+            unique_ptr<Client> &client = clients[key];
+            if (!client) {
+                char addr[INET_ADDRSTRLEN];
+                inet_ntop(AF_INET, &from.sin_addr, addr, sizeof(addr));
+                c150debug->printf(C150APPLICATION, "New client %s:%d\n", addr,
+                                  ntohs(from.sin_port));
+                client.reset(new Client(dir, nfp, disk, from));
+                Client *c = client.get();
+                c->cache.onDiskDone([sock, c](int id) {
+                    // answer the CHECKs that were waiting for the file right
+                    // away, rather than at the client's next poll
+                    vector<Packet> waiting;
+                    waiting.swap(c->parked);
+                    vector<Packet *> again;
+                    for (Packet &p : waiting) {
+                        if (p.hdr.fid == id)
+                            again.push_back(&p);
+                        else
+                            c->parked.push_back(p);
+                    }
+                    if (!again.empty())
+                        respond(sock, *c, again.data(), again.size());
+                });
+            }
+
+            client->lastHeard = EventLoop::clock::now();
+            int n = 0;
+            for (int i = start; i < end; i++) {
+                Packet &p = burst[i].packet;
+                if (lens[i] != p.hdr.len) {
+                    c150debug->printf(
+                        C150APPLICATION,
+                        "Received a packet with length %lu but expected "
+                        "length was %d\n",
+                        lens[i], p.hdr.len);
+                    continue;
+                }
+                packets[n++] = &p;
+            }
+            if (n > 0) respond(sock, *client, packets, n);
+        }
+    };
+
+    // Wait for packets (and finished disk work) on an event loop, never
+    // blocking in a read
+    EventLoop loop;
+    loop.watch(sock->fd(), onReadable);
+    if (disk) loop.watch(disk->completionFd(), [disk]() { disk->reap(); });
+
+    // A client is only dropped once its disk jobs, which refer to its
+    // cache, have finished and its parked CHECKs have been answered
+    auto idle = chrono::milliseconds(CLIENT_IDLE_TIMEOUT);
+    function<void()> sweep = [&]() {
+        EventLoop::clock::time_point now = EventLoop::clock::now();
+        for (auto it = clients.begin(); it != clients.end();) {
+            Client &c = *it->second;
+            if (now - c.lastHeard >= idle && !c.cache.diskBusy() &&
+                c.parked.empty()) {
+                c150debug->printf(C150APPLICATION,
+                                  "Forgetting idle client on port %d\n",
+                                  ntohs(c.addr.sin_port));
+                it = clients.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        loop.at(now + idle / 2, sweep);
+    };
+    loop.at(EventLoop::clock::now() + idle / 2, sweep);
+    loop.run();
 }
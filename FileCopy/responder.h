@@ -1,10 +1,10 @@
 #ifndef RESPONDER_H
 #define RESPONDER_H
 
-#include "c150nastydgmsocket.h"
 #include "c150nastyfile.h"
 #include "filecache.h"
 #include "packet.h"
+#include "udpsocket.h"
 
 class ServerResponder {
    public:
@@ -15,14 +15,22 @@ class ServerResponder {
     //
     // modifies packet IN PLACE by changing type to ACK or SOS
     // so can safely get the filename and seqno back from ACK or SOS
-    void bounce(Packet *p);
+    //
+    // Sets *recovered to the seqno of a section the packet let us rebuild
+    // from parity, which deserves an ACK too, or -1 if none.
+    //
+    // Returns false, leaving the packet alone, if it can't be answered yet:
+    // a CHECK_IS_NECESSARY for a file the disk workers are still writing or
+    // checking. Answer PENDING meanwhile, and bounce it again once the
+    // Filecache says they're done.
+    bool bounce(Packet *p, seq_t *recovered);
 
    private:
     Filecache *m_cache;
 };
 
-// main server call
-void listen(C150NETWORK::C150DgmSocket *sock, C150NETWORK::C150NastyFile *nfp,
+// main server call, disk may be nullptr to do all disk work in line
+void listen(UdpSocket *sock, C150NETWORK::C150NastyFile *nfp, DiskPool *disk,
             std::string dir);
 
 #endif
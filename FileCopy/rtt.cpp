@@ -0,0 +1,39 @@
+#include "rtt.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+// Gains from RFC 6298
+#define RTT_ALPHA 0.125
+#define RTT_BETA 0.25
+
+RttEstimator::RttEstimator() {
+    m_hasSample = false;
+    m_srtt = 0;
+    m_rttvar = 0;
+    m_rto = MESSENGER_TIMEOUT;
+}
+
+void RttEstimator::sample(double rtt_ms) {
+    if (!m_hasSample) {
+        m_srtt = rtt_ms;
+        m_rttvar = rtt_ms / 2;
+        m_hasSample = true;
+    } else {
+        // variance must use the old srtt, so update it first
+        m_rttvar = (1 - RTT_BETA) * m_rttvar + RTT_BETA * fabs(m_srtt - rtt_ms);
+        m_srtt = (1 - RTT_ALPHA) * m_srtt + RTT_ALPHA * rtt_ms;
+    }
+    // a fresh sample also undoes any backoff
+    updateRto();
+}
+
+void RttEstimator::backoff() { m_rto = min(m_rto * 2, MAX_RTO); }
+
+void RttEstimator::updateRto() {
+    // the 4 * rttvar term can't be smaller than the clock granularity
+    double rto = m_srtt + max((double)MESSENGER_TICK, 4 * m_rttvar);
+    m_rto = max(MIN_RTO, min((int)ceil(rto), MAX_RTO));
+}
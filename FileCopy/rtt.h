@@ -0,0 +1,38 @@
+#ifndef RTT_H
+#define RTT_H
+
+#include "settings.h"
+
+// Round trip time estimator (Jacobson/Karels, as in RFC 6298).
+//
+// Keeps a smoothed RTT and RTT variance from ACK timings, and derives the
+// retransmission timeout from them. Timeouts back the RTO off exponentially
+// until the next good sample arrives.
+class RttEstimator {
+   public:
+    RttEstimator();
+
+    // Feed one round trip measurement in milliseconds. Only measure
+    // messages that were sent exactly once (Karn's algorithm), otherwise
+    // we can't tell which transmission the ACK belongs to.
+    void sample(double rtt_ms);
+
+    // Call when a retransmission timer fires, doubles the RTO
+    void backoff();
+
+    // Current retransmission timeout in milliseconds
+    int rto() const { return m_rto; }
+
+    double srtt() const { return m_srtt; }
+    double rttvar() const { return m_rttvar; }
+
+   private:
+    void updateRto();
+
+    bool m_hasSample;
+    double m_srtt;
+    double m_rttvar;
+    int m_rto;
+};
+
+#endif
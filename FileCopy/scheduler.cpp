@@ -0,0 +1,37 @@
+#include "scheduler.h"
+
+#include <utility>
+
+using namespace std;
+
+Scheduler::Scheduler() {}
+
+// Unfinished tasks are destroyed with their Tasks, wherever they stopped
+Scheduler::~Scheduler() {}
+
+void Scheduler::spawn(Task<> task) {
+    m_ready.push_back(task.handle());
+    m_tasks.push_back(move(task));
+}
+
+void Scheduler::wake(coroutine_handle<> h) { m_ready.push_back(h); }
+
+void Scheduler::runReady() {
+    while (!m_ready.empty()) {
+        coroutine_handle<> h = m_ready.front();
+        m_ready.pop_front();
+        h.resume();
+    }
+
+    // Reap the finished tasks, passing on what they threw
+    for (size_t i = 0; i < m_tasks.size();) {
+        if (!m_tasks[i].done()) {
+            i++;
+            continue;
+        }
+        Task<> task = move(m_tasks[i]);
+        m_tasks[i] = move(m_tasks.back());
+        m_tasks.pop_back();
+        task.result();
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <vector>
+
+#include "task.h"
+
+// Single threaded scheduler for coroutines.
+//
+// Spawned tasks run until they co_await something that isn't ready. Whoever
+// completes that something wakes them up again with wake(), and they carry
+// on at the next runReady(). Nothing runs in parallel, so coroutines share
+// data without locks, and a suspended one costs nothing but its frame.
+class Scheduler {
+   public:
+    Scheduler();
+    ~Scheduler();
+
+    // Takes over the task, which starts at the next runReady()
+    void spawn(Task<> task);
+
+    // Makes a suspended coroutine runnable again
+    void wake(std::coroutine_handle<> h);
+
+    // Resumes runnable coroutines until all of them are waiting on
+    // something (or finished). Rethrows the exception of a spawned task
+    // that threw.
+    void runReady();
+
+    // Number of spawned tasks that haven't finished yet
+    size_t live() const { return m_tasks.size(); }
+
+   private:
+    std::deque<std::coroutine_handle<>> m_ready;
+    std::vector<Task<>> m_tasks;
+};
+
+#endif
@@ -0,0 +1,108 @@
+#ifndef SENDWINDOW_H
+#define SENDWINDOW_H
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+#include "packet.h"
+
+// The messages of a sliding window, in a ring buffer indexed by seqno.
+//
+// Seqnos are handed out densely and the window never spans more than N of
+// them, so seqno & (N - 1) is a slot no other in-flight message can have.
+// Each slot has a state byte, and a bitmap marks the un-ACK'd slots, so
+// lookups are an index, and walking the window is a scan over contiguous
+// words that skips whole runs of ACK'd slots at once. Nothing is hashed,
+// and nothing is allocated after construction.
+//
+// N must be a power of two, and at least 64 (a word of the bitmap).
+template <typename T, size_t N>
+class SendWindow {
+    static_assert(N >= 64 && (N & (N - 1)) == 0,
+                  "N must be a power of two, at least 64");
+
+   public:
+    SendWindow() : m_slots(N), m_state(N, EMPTY), m_unacked(N / 64, 0) {
+        m_base = m_end = 0;
+        m_size = 0;
+    }
+
+    // Empties the window, which starts again at seqno base
+    void reset(seq_t base) {
+        forEach([this](seq_t seqno, T &) { erase(seqno); });
+        m_base = m_end = base;
+    }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // The oldest un-ACK'd seqno, or one past the newest if there is none
+    seq_t base() const { return m_base; }
+
+    // The message with that seqno, nullptr if it isn't in flight
+    T *find(seq_t seqno) {
+        if (seqno < m_base || seqno >= m_end) return nullptr;
+        size_t i = seqno & (N - 1);
+        return m_state[i] == INFLIGHT ? &m_slots[i] : nullptr;
+    }
+
+    // Adds the message with seqno, which must be newer than every other
+    // one and less than N past base()
+    T &insert(seq_t seqno, const T &value) {
+        assert(seqno >= m_end && seqno - m_base < (seq_t)N);
+        if (m_size == 0) m_base = seqno;
+        m_end = seqno + 1;
+        size_t i = seqno & (N - 1);
+        m_slots[i] = value;
+        m_state[i] = INFLIGHT;
+        m_unacked[i / 64] |= 1ull << (i % 64);
+        m_size++;
+        return m_slots[i];
+    }
+
+    // Retires the message with seqno, if it is in flight
+    void erase(seq_t seqno) {
+        if (!find(seqno)) return;
+        size_t i = seqno & (N - 1);
+        m_state[i] = EMPTY;
+        m_unacked[i / 64] &= ~(1ull << (i % 64));
+        m_size--;
+        if (seqno == m_base) m_base = next(seqno + 1);
+    }
+
+    // Calls f(seqno, message) for every message in flight, oldest first.
+    // f may erase the message it is given, but nothing else.
+    template <typename F>
+    void forEach(F f) {
+        for (seq_t seqno = next(m_base); seqno < m_end;
+             seqno = next(seqno + 1))
+            f(seqno, m_slots[seqno & (N - 1)]);
+    }
+
+   private:
+    enum SlotState : uint8_t { EMPTY, INFLIGHT };
+
+    // The first in-flight seqno from seqno on, m_end if none
+    seq_t next(seq_t seqno) const {
+        while (seqno < m_end) {
+            size_t i = seqno & (N - 1);
+            uint64_t word = m_unacked[i / 64] >> (i % 64);
+            if (word) {
+                seqno += __builtin_ctzll(word);
+                break;
+            }
+            seqno += 64 - i % 64;  // nothing else in this word
+        }
+        return seqno < m_end ? seqno : m_end;
+    }
+
+    std::vector<T> m_slots;
+    std::vector<uint8_t> m_state;
+    std::vector<uint64_t> m_unacked;  // a bit per slot
+    seq_t m_base;  // oldest in-flight seqno, m_end if none
+    seq_t m_end;   // one past the newest seqno given a slot
+    size_t m_size;
+};
+
+#endif
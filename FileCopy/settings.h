@@ -4,15 +4,98 @@
 #define MAX_DISK_RETRIES 50
 #define MAX_FILENAME_LENGTH 80
 #define HASH_MATCHES 10
+// Most reads of a block to vote on
 #define HASH_SAMPLES 200
+// Reads stop early once the most common checksum is right with at least
+// this probability, even supposing every bad read could come back the same
+// way. Without bad reads that takes 4 reads, more the more of them we see.
+#define READ_CONFIDENCE 0.999
+// Files are read and voted on this many bytes at a time, so a bad read
+// only costs a re-read of its block
+#define VOTE_BLOCK (64 * 1024)
 
 // Messenger settings
+// Time a packet may stay un-ACK'd before it is resent (ms). This is only
+// the starting point, the messenger adapts it from measured round trips
 #define MESSENGER_TIMEOUT 1000
+// Bounds on the adaptive retransmission timeout (ms)
+#define MIN_RTO 20
+#define MAX_RTO 8000
+// How late a resend or pacing timer may fire, give or take (ms)
+#define MESSENGER_TICK 5
+// Number of times a single packet is resent before the send is abandoned
 #define MAX_RESEND_ATTEMPTS 10
+// How long to wait before asking again about a message the server answered
+// PENDING (ms). The server answers as soon as it can anyway, this is in
+// case that answer gets lost.
+#define PENDING_POLL 250
+
+// Most datagrams read or written with a single system call
+#define MAX_BURST 64
+
+// Number of SACKs that may skip over an un-ACK'd packet before it is
+// assumed lost and resent without waiting for its timeout
+#define DUP_SACK_THRESHOLD 3
+
+// Server sends a SACK at the end of each burst of BLOB_SECTIONs, or
+// sooner if this many are waiting on an ACK
+#define SACK_EVERY 32
+
+// The server forgets a client it hasn't heard from in this long (ms), once
+// none of its disk work is left
+#define CLIENT_IDLE_TIMEOUT 60000
 
 // Number of times the client manager will try to send a file before giving up
 #define MAX_SOS_COUNT 4
 
-#define MAX_SEND_GROUP 200
+// The client manager sends files in batches that share one window, of at
+// most this many files or (roughly) bytes
+#define MAX_BATCH_FILES 1000
+#define MAX_BATCH_BYTES (32 * 1024 * 1024)
+
+// Bounds on the number of un-ACK'd packets in flight at once, the
+// congestion controller picks the actual window in between. The max is
+// also the size of the send window's ring buffer, a power of two.
+#define MIN_SEND_WINDOW 2
+#define INITIAL_SEND_WINDOW 10
+#define MAX_SEND_WINDOW 1024
+// Congestion controller used unless another is picked at runtime
+#define DEFAULT_CONGESTION_CONTROL "reno"
+
+// Pacing: unless a rate is configured, datagrams are spaced to send a
+// window per smoothed RTT, times PACING_GAIN so pacing alone never holds
+// the window back. At most PACING_BURST datagrams go out back to back.
+#define PACING_GAIN 1.25
+#define PACING_BURST 16
+
+// Probing for the datagram size: each size gets this many tries, each
+// waiting this long (ms) for an answer
+#define PROBE_ATTEMPTS 3
+#define PROBE_TIMEOUT 200
+
+// Forward error correction, when turned on: one BLOB_PARITY per group of
+// sections, sized so a group expects about FEC_GROUP_LOSSES losses at the
+// loss rate we observe. No parity at all below FEC_MIN_LOSS.
+#define FEC_GROUP_LOSSES 0.25
+#define FEC_MIN_LOSS 0.002
+#define MIN_FEC_GROUP 4
+#define MAX_FEC_GROUP 32
+// Weight of each sent message in the running loss rate
+#define FEC_LOSS_GAIN (1.0 / 256)
+
+// Fewest disk workers per server thread, unless fileserver -w says
+// otherwise (0 to do disk work on the server thread itself). Checks are CPU
+// bound, so by default each server thread gets its share of the CPUs.
+#define DISK_WORKERS 2
+// Most jobs waiting for one disk worker, a power of two
+#define DISK_QUEUE_SIZE 256
+// The server writes a file's sections to its .tmp file as they arrive, a
+// batch at a time once this many bytes are waiting
+#define STREAM_CHUNK (64 * 1024)
+// Section buffers are carved out of slabs of about this many bytes
+#define ARENA_SLAB_BYTES (64 * 1024)
+// Largest file the server takes. The .tmp file is preallocated from what
+// the client claims, so a bogus PREPARE_FOR_BLOB can't ask for more.
+#define MAX_BLOB_SIZE (1L << 30)
 
 #endif
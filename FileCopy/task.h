@@ -0,0 +1,111 @@
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+// Coroutine returning a T, for co_await'ing from other coroutines or for
+// running on a Scheduler (see scheduler.h).
+//
+// A Task is lazy: its body doesn't start until it is awaited (or spawned),
+// and when it finishes it resumes whoever awaited it right away, without
+// going back through the scheduler. Exceptions are handed over to the
+// awaiter too.
+//
+//     Task<bool> sendIt(Messenger *m, Packet p) {
+//         bool ok = co_await m->sendAsync(p);
+//         co_return ok;
+//     }
+
+namespace detail {
+
+// Where the promise keeps the result, co_return needs a different member
+// for void
+template <typename T>
+struct TaskResult {
+    T value{};
+    void return_value(T v) { value = std::move(v); }
+    T take() { return std::move(value); }
+};
+
+template <>
+struct TaskResult<void> {
+    void return_void() {}
+    void take() {}
+};
+
+}  // namespace detail
+
+template <typename T = void>
+class Task {
+   public:
+    struct promise_type : detail::TaskResult<T> {
+        std::exception_ptr error;
+        std::coroutine_handle<> continuation;  // who awaits us, if anyone
+
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(
+                *this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+
+        // Hand control straight to the awaiter (symmetric transfer), or
+        // just stop if nobody awaits us
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(
+                std::coroutine_handle<promise_type> h) noexcept {
+                std::coroutine_handle<> next = h.promise().continuation;
+                return next ? next : std::noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void unhandled_exception() { error = std::current_exception(); }
+    };
+    typedef std::coroutine_handle<promise_type> handle_type;
+
+    Task() : m_handle(nullptr) {}
+    explicit Task(handle_type h) : m_handle(h) {}
+    Task(Task &&other) noexcept : m_handle(other.m_handle) {
+        other.m_handle = nullptr;
+    }
+    Task &operator=(Task &&other) noexcept {
+        if (this != &other) {
+            if (m_handle) m_handle.destroy();
+            m_handle = other.m_handle;
+            other.m_handle = nullptr;
+        }
+        return *this;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (m_handle) m_handle.destroy();
+    }
+
+    bool done() const { return !m_handle || m_handle.done(); }
+    handle_type handle() const { return m_handle; }
+
+    // The result of a finished task, rethrowing what it threw
+    T result() {
+        if (m_handle.promise().error)
+            std::rethrow_exception(m_handle.promise().error);
+        return m_handle.promise().take();
+    }
+
+    // co_await task: runs it, and comes back with its result
+    bool await_ready() const noexcept { return done(); }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) {
+        m_handle.promise().continuation = awaiter;
+        return m_handle;
+    }
+    T await_resume() { return result(); }
+
+   private:
+    handle_type m_handle;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#include "../acktracker.h"
+#include "../settings.h"
+#include "check.h"
+
+// Seqnos that come in order, and around a hole
+static void testHoles() {
+    AckTracker acks;
+    Packet sack = acks.toSack();
+    EXPECT(sack.hdr.type == SACK);
+    EXPECT(sack.value.sack.cumack == -1 && sack.value.sack.nranges == 0);
+    EXPECT(!sack.sacks(0));
+
+    for (seq_t s : {0, 1, 3, 4, 7}) acks.ack(s);
+    EXPECT(acks.pending() == 5);
+    sack = acks.toSack();
+    EXPECT(acks.pending() == 0);
+    EXPECT(sack.value.sack.cumack == 1);
+    EXPECT(sack.value.sack.nranges == 2);
+    EXPECT(sack.sacks(1) && sack.sacks(3) && sack.sacks(4) && sack.sacks(7));
+    EXPECT(!sack.sacks(2) && !sack.sacks(5) && !sack.sacks(6));
+    EXPECT(!sack.sacks(8));
+
+    acks.ack(6);  // merges with the range above
+    acks.ack(5);  // and the one below
+    acks.ack(4);  // again, still counts as an ACK to answer
+    EXPECT(acks.pending() == 3);
+    sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 1 && sack.value.sack.nranges == 1);
+    EXPECT(sack.value.sack.ranges[0].first == 3);
+    EXPECT(sack.value.sack.ranges[0].last == 7);
+
+    acks.ack(2);  // fills the hole
+    sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 7 && sack.value.sack.nranges == 0);
+}
+
+// An SOS'd seqno is never reported, wherever it was
+static void testSos() {
+    AckTracker acks;
+    for (seq_t s = 0; s < 10; s++) acks.ack(s);
+    acks.ack(12);
+    acks.ack(13);
+    acks.ack(14);
+
+    acks.sos(5);   // under the cumulative ACK
+    acks.sos(13);  // in the middle of a range
+    acks.sos(11);  // never ACK'd, nothing to do
+    Packet sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 4);
+    EXPECT(!sack.sacks(5) && !sack.sacks(11) && !sack.sacks(13));
+    EXPECT(sack.sacks(4) && sack.sacks(6) && sack.sacks(9));
+    EXPECT(sack.sacks(12) && sack.sacks(14));
+    EXPECT(sack.value.sack.nranges == 3);
+
+    acks.ack(5);  // resent and ACK'd this time
+    sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 9);
+}
+
+// Holes MAX_SEND_WINDOW below the highest seqno are folded into the
+// cumulative ACK, the messenger has given up on them
+static void testFolding() {
+    AckTracker acks;
+    acks.ack(0);
+    acks.ack(3);
+    acks.ack(MAX_SEND_WINDOW);
+    Packet sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 0);  // exactly the window, not yet
+    EXPECT(!sack.sacks(1));
+
+    acks.ack(MAX_SEND_WINDOW + 2);
+    sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 3);  // 1 and 2 folded, then 3 merged
+    EXPECT(sack.sacks(1) && sack.sacks(2));
+    EXPECT(!sack.sacks(4) && !sack.sacks(MAX_SEND_WINDOW - 1));
+    EXPECT(sack.value.sack.nranges == 2);
+
+    // a hole that lasts a whole window is folded over too, the ranges
+    // above it with it
+    seq_t top = 3 * MAX_SEND_WINDOW;
+    acks.ack(top);
+    sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == top - MAX_SEND_WINDOW);
+    EXPECT(sack.value.sack.nranges == 1);
+    EXPECT(sack.sacks(top) && !sack.sacks(top - 1));
+}
+
+// A seqno far below the cumulative ACK means the client started over
+static void testRestart() {
+    AckTracker acks;
+    for (seq_t s = 0; s <= 4 * MAX_SEND_WINDOW; s++) acks.ack(s);
+    acks.ack(3);
+    Packet sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == -1);
+    EXPECT(sack.sacks(3) && !sack.sacks(4) && !sack.sacks(0));
+}
+
+// A SACK lists only as many ranges as fit, the lowest ones
+static void testManyRanges() {
+    AckTracker acks;
+    acks.ack(0);
+    for (int i = 1; i <= MAX_SACK_RANGES + 5; i++) acks.ack(2 * i);
+    Packet sack = acks.toSack();
+    EXPECT(sack.value.sack.cumack == 0);
+    EXPECT((int)sack.value.sack.nranges == MAX_SACK_RANGES);
+    EXPECT(sack.sacks(2) && sack.sacks(2 * MAX_SACK_RANGES));
+    EXPECT(!sack.sacks(2 * MAX_SACK_RANGES + 2));
+}
+
+int main() {
+    testHoles();
+    testSos();
+    testFolding();
+    testRestart();
+    testManyRanges();
+    return testResult("acktrackertest");
+}
@@ -0,0 +1,90 @@
+#include <cstring>
+#include <vector>
+
+#include "../arena.h"
+#include "../settings.h"
+#include "check.h"
+
+using namespace std;
+
+const size_t SLOT = 1000;
+const size_t PER_SLAB = ARENA_SLAB_BYTES / SLOT;
+
+// Slots come in order from one slab until it runs out, then from another
+static void testExhaustion() {
+    SectionArena arena(SLOT);
+    EXPECT(arena.slotSize() == SLOT);
+    vector<uint8_t *> slots;
+    for (size_t i = 0; i < 3 * PER_SLAB; i++) {
+        slots.push_back(arena.alloc());
+        memset(slots.back(), (int)i, SLOT);
+    }
+
+    bool inOrder = true;
+    int newSlabs = 0;
+    for (size_t i = 1; i < slots.size(); i++) {
+        if (i % PER_SLAB)
+            inOrder = inOrder && slots[i] == slots[i - 1] + SLOT;
+        else if (slots[i] != slots[i - 1] + SLOT)
+            newSlabs++;
+    }
+    EXPECT(inOrder);
+    EXPECT(newSlabs == 2);
+
+    // nothing written over anything else
+    bool intact = true;
+    for (size_t i = 0; i < slots.size(); i++)
+        for (size_t j = 0; j < SLOT; j++)
+            intact = intact && slots[i][j] == (uint8_t)i;
+    EXPECT(intact);
+    for (uint8_t *slot : slots) arena.free(slot);
+}
+
+// A slab whose slots are all freed is kept as the spare, and the next slab
+// needed is that one
+static void testSpareReuse() {
+    SectionArena arena(SLOT);
+    vector<uint8_t *> first, second;
+    for (size_t i = 0; i < PER_SLAB; i++) first.push_back(arena.alloc());
+    second.push_back(arena.alloc());  // starts the second slab
+
+    // freeing all but one keeps the first slab
+    for (size_t i = 1; i < PER_SLAB; i++) arena.free(first[i]);
+    for (size_t i = 1; i < PER_SLAB; i++) second.push_back(arena.alloc());
+    uint8_t *third = arena.alloc();  // a fresh slab, the first is in use
+    EXPECT(third != first[0]);
+
+    // now the first goes spare, and comes back when the third runs out
+    arena.free(first[0]);
+    for (size_t i = 1; i < PER_SLAB; i++) arena.alloc();
+    EXPECT(arena.alloc() == first[0]);
+
+    // a current slab emptied out is still current, not handed back
+    SectionArena other(SLOT);
+    uint8_t *slot = other.alloc();
+    other.free(slot);
+    EXPECT(other.alloc() == slot + SLOT);
+    other.free(slot + SLOT);
+}
+
+// Slots bigger than a slab get one each
+static void testBigSlots() {
+    size_t big = ARENA_SLAB_BYTES + 1;
+    SectionArena arena(big);
+    uint8_t *a = arena.alloc();
+    uint8_t *b = arena.alloc();
+    memset(a, 1, big);
+    memset(b, 2, big);
+    EXPECT(a[big - 1] == 1 && b[0] == 2);
+    EXPECT(b >= a + big || a >= b + big);
+
+    arena.free(a);  // spare now
+    EXPECT(arena.alloc() == a);
+}
+
+int main() {
+    testExhaustion();
+    testSpareReuse();
+    testBigSlots();
+    return testResult("arenatest");
+}
@@ -0,0 +1,28 @@
+#ifndef TESTS_CHECK_H
+#define TESTS_CHECK_H
+
+#include <cstdio>
+
+// Just enough for the tests here: EXPECT reports a condition that doesn't
+// hold and carries on, and main returns testResult(), nonzero if any
+// didn't.
+static int g_failures = 0;
+
+#define EXPECT(cond)                                                       \
+    do {                                                                   \
+        if (!(cond)) {                                                     \
+            fprintf(stderr, "%s:%d: expected %s\n", __FILE__, __LINE__,    \
+                    #cond);                                                \
+            g_failures++;                                                  \
+        }                                                                  \
+    } while (0)
+
+static inline int testResult(const char *name) {
+    if (g_failures > 0)
+        fprintf(stderr, "%s: %d failed\n", name, g_failures);
+    else
+        printf("%s: passed\n", name);
+    return g_failures > 0;
+}
+
+#endif
@@ -0,0 +1,54 @@
+#include <openssl/sha.h>
+
+#include <cstring>
+
+#include "../checksumvote.h"
+#include "check.h"
+
+// Each row is a run of reads of one block, a letter per checksum, how many
+// of them it takes for the vote to decide (0 if it never does) and which
+// checksum leads at the end
+struct Row {
+    const char *reads;
+    int decidedAt;
+    char leader;
+};
+
+static const Row ROWS[] = {
+    // unanimous: 3 reads leave (1/7)^3 = 0.0029, 4 decide
+    {"AAA", 0, 'A'},
+    {"AAAA", 4, 'A'},
+    // 2 vs 1, wherever the odd one is
+    {"AAB", 0, 'A'},
+    {"ABA", 0, 'A'},
+    {"BAA", 0, 'A'},
+    {"AABAAAA", 7, 'A'},
+    // 3-way split, the first one leads the tie
+    {"ABC", 0, 'A'},
+    {"CBA", 0, 'C'},
+    {"ABCAAAAAAA", 10, 'A'},
+    {"ABCBBBBBBB", 10, 'B'},
+    // a tie never decides
+    {"ABAB", 0, 'A'},
+};
+
+int main() {
+    for (const Row &row : ROWS) {
+        ChecksumVote vote;
+        char leader = 0;
+        int n = strlen(row.reads);
+        for (int i = 0; i < n; i++) {
+            unsigned char checksum[SHA_DIGEST_LENGTH];
+            memset(checksum, row.reads[i], sizeof(checksum));
+            if (vote.add(checksum)) leader = row.reads[i];
+            bool decided = row.decidedAt > 0 && i + 1 >= row.decidedAt;
+            if (vote.decided() != decided)
+                fprintf(stderr, "%s after %d reads:\n", row.reads, i + 1);
+            EXPECT(vote.decided() == decided);
+        }
+        EXPECT(vote.reads() == n);
+        if (leader != row.leader) fprintf(stderr, "%s:\n", row.reads);
+        EXPECT(leader == row.leader);
+    }
+    return testResult("checksumvotetest");
+}
@@ -0,0 +1,91 @@
+#include <memory>
+
+#include "../congestion.h"
+#include "check.h"
+
+using namespace std;
+
+// Slow start doubles the window each round trip, until a loss halves it,
+// then it grows by one per round trip
+static void testReno() {
+    RenoController reno;
+    EXPECT(reno.window() == INITIAL_SEND_WINDOW);
+    reno.onAck(10, 50);
+    EXPECT(reno.window() == 20);
+    reno.onAck(20, 50);
+    EXPECT(reno.window() == 40);
+
+    reno.onLoss();
+    EXPECT(reno.window() == 20);
+    reno.onAck(20, 50);  // a round trip's worth
+    EXPECT(reno.window() == 20 || reno.window() == 21);
+    reno.onAck(21 + 22 + 23, 50);  // three more
+    EXPECT(reno.window() >= 23 && reno.window() <= 24);
+
+    // a timeout starts over from the bottom, slow start up to half of
+    // where it was, then linear again
+    reno.onTimeout();
+    EXPECT(reno.window() == MIN_SEND_WINDOW);
+    reno.onAck(9, 50);
+    EXPECT(reno.window() == 11);
+    reno.onAck(11, 50);
+    EXPECT(reno.window() < 13);
+
+    // never outside the limits
+    reno.onAck(1000000, 50);
+    EXPECT(reno.window() == MAX_SEND_WINDOW);
+    for (int i = 0; i < 20; i++) reno.onLoss();
+    EXPECT(reno.window() == MIN_SEND_WINDOW);
+    reno.onTimeout();
+    EXPECT(reno.window() == MIN_SEND_WINDOW);
+}
+
+// Grows while the RTT stays at its lowest, holds while a few messages are
+// queued, shrinks once more are, and halves on loss like Reno
+static void testDelay() {
+    DelayController delay;
+    EXPECT(delay.window() == INITIAL_SEND_WINDOW);
+    delay.onAck(10, -1);  // no sample yet, slow start like Reno
+    EXPECT(delay.window() == 20);
+    delay.onAck(20, 100);  // the base RTT, nothing queued
+    EXPECT(delay.window() == 40);
+
+    // 40 * (1 - 100/125) = 8 queued: leaves slow start and backs off
+    delay.onAck(1, 125);
+    EXPECT(delay.window() == 40);
+    delay.onAck(40, 125);
+    EXPECT(delay.window() == 39);
+
+    // 39 * (1 - 100/110) = 3.5 queued, between alpha and beta: holds
+    delay.onAck(200, 110);
+    EXPECT(delay.window() == 39);
+
+    // back at the base RTT, + 1 per round trip rather than doubling
+    delay.onAck(40, 100);
+    EXPECT(delay.window() == 40);
+    delay.onAck(40, 90);  // a new, lower base
+    EXPECT(delay.window() == 41);
+
+    delay.onLoss();
+    EXPECT(delay.window() == 20);
+    delay.onTimeout();
+    EXPECT(delay.window() == MIN_SEND_WINDOW);
+    // slow start again, up to the new threshold
+    delay.onAck(3, 90);
+    EXPECT(delay.window() == MIN_SEND_WINDOW + 3);
+}
+
+static void testMake() {
+    unique_ptr<CongestionController> reno(makeCongestionController("reno"));
+    unique_ptr<CongestionController> delay(makeCongestionController("delay"));
+    EXPECT(reno && string(reno->name()) == "reno");
+    EXPECT(delay && string(delay->name()) == "delay");
+    EXPECT(makeCongestionController("cubic") == nullptr);
+}
+
+int main() {
+    testReno();
+    testDelay();
+    testMake();
+    return testResult("congestiontest");
+}
@@ -0,0 +1,69 @@
+#include <chrono>
+
+#include "../pacer.h"
+#include "../packet.h"
+#include "check.h"
+
+using namespace std;
+using namespace std::chrono;
+
+// Without a rate nothing is held back
+static void testUnpaced() {
+    Pacer pacer;
+    auto now = Pacer::clock::now();
+    for (int i = 0; i < 1000; i++) pacer.charge(MAX_PACKET_SIZE);
+    EXPECT(pacer.ready(now));
+    EXPECT(pacer.whenReady(now) == now);
+}
+
+// The bucket refills at the rate, up to its depth, and debts are paid off
+// before anything else goes
+static void testRefill() {
+    Pacer pacer;
+    pacer.setRate(1e6);  // a byte a microsecond
+    pacer.setBurst(4000);
+    // the depth is at least a tick's worth
+    const int depth = 1e6 * MESSENGER_TICK / 1000;
+    auto t = Pacer::clock::now() + seconds(1);
+
+    // full after a quiet spell, and no fuller
+    EXPECT(pacer.ready(t));
+    pacer.charge(depth - 1);
+    EXPECT(pacer.ready(t));
+    pacer.charge(1);
+    EXPECT(!pacer.ready(t));
+
+    // overdrawn by 3000 bytes, 3ms to pay off
+    pacer.charge(3000);
+    auto ready = pacer.whenReady(t);
+    EXPECT(ready > t + microseconds(3000));
+    EXPECT(ready < t + microseconds(3010));
+    EXPECT(!pacer.ready(t + microseconds(2990)));
+    EXPECT(pacer.ready(ready));
+
+    // half a millisecond later there's room for about 500 bytes
+    t = ready + microseconds(500);
+    EXPECT(pacer.ready(t));
+    pacer.charge(490);
+    EXPECT(pacer.ready(t));
+    pacer.charge(20);
+    EXPECT(!pacer.ready(t));
+
+    // a deeper bucket holds more
+    pacer.setBurst(3 * depth);
+    t += seconds(1);
+    EXPECT(pacer.ready(t));
+    pacer.charge(3 * depth - 1);
+    EXPECT(pacer.ready(t));
+
+    // and a shallower one throws the extra away at once
+    pacer.setBurst(100);
+    pacer.charge(100);
+    EXPECT(!pacer.ready(t));
+}
+
+int main() {
+    testUnpaced();
+    testRefill();
+    return testResult("pacertest");
+}
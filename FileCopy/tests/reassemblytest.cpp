@@ -0,0 +1,117 @@
+#include <algorithm>
+#include <cstdlib>
+#include <set>
+#include <vector>
+
+#include "../reassembly.h"
+#include "check.h"
+
+using namespace std;
+
+// Missing ranges as flat first, last pairs, for comparing
+static vector<uint32_t> gaps(const Reassembly &parts, size_t max = 1000) {
+    vector<PartRange> ranges;
+    parts.missing(ranges, max);
+    vector<uint32_t> flat;
+    for (auto &range : ranges) {
+        flat.push_back(range.first);
+        flat.push_back(range.last);
+    }
+    return flat;
+}
+
+// Sections arriving out of order, some twice, in a blob whose last section
+// sits alone in the last word of bits
+static void testOutOfOrder() {
+    Reassembly parts(130);
+    EXPECT(parts.size() == 130 && parts.remaining() == 130);
+    EXPECT((gaps(parts) == vector<uint32_t>{0, 129}));
+
+    EXPECT(parts.mark(129));  // the last, partial section first
+    EXPECT(parts.has(129) && !parts.has(128));
+    EXPECT((gaps(parts) == vector<uint32_t>{0, 128}));
+    EXPECT(parts.mark(64));
+    EXPECT(parts.mark(0));
+    EXPECT(parts.mark(63));
+    EXPECT((gaps(parts) == vector<uint32_t>{1, 62, 65, 128}));
+    EXPECT(parts.remaining() == 126);
+
+    EXPECT(!parts.mark(64));  // duplicates change nothing
+    EXPECT(!parts.mark(129));
+    EXPECT(!parts.mark(130));  // out of range
+    EXPECT(!parts.has(130));
+    EXPECT(parts.remaining() == 126);
+    EXPECT((gaps(parts) == vector<uint32_t>{1, 62, 65, 128}));
+
+    // at most max ranges, lowest first
+    EXPECT((gaps(parts, 1) == vector<uint32_t>{1, 62}));
+    EXPECT(gaps(parts, 0).empty());
+
+    for (uint32_t p = 128; p >= 65; p--) parts.mark(p);
+    for (uint32_t p = 1; p <= 62; p++) parts.mark(p);
+    EXPECT(parts.complete());
+    EXPECT(gaps(parts).empty());
+
+    parts.reset();
+    EXPECT(parts.remaining() == 130 && !parts.has(0) && !parts.has(129));
+    EXPECT((gaps(parts) == vector<uint32_t>{0, 129}));
+}
+
+// Blobs of no sections and of one
+static void testTiny() {
+    Reassembly none;
+    EXPECT(none.complete());
+    EXPECT(!none.mark(0));
+    EXPECT(gaps(none).empty());
+
+    Reassembly one(1);
+    EXPECT(!one.complete());
+    EXPECT((gaps(one) == vector<uint32_t>{0, 0}));
+    EXPECT(one.mark(0));
+    EXPECT(one.complete());
+    EXPECT(gaps(one).empty());
+}
+
+// Every section in a random order, each arriving up to twice, checking the
+// index of missing ranges against a set of what hasn't arrived
+static void testShuffled(uint32_t nparts, unsigned seed) {
+    Reassembly parts(nparts);
+    set<uint32_t> left;
+    vector<uint32_t> order;
+    for (uint32_t p = 0; p < nparts; p++) {
+        left.insert(p);
+        order.push_back(p);
+        if (p % 3 == 0) order.push_back(p);
+    }
+    srand(seed);
+    for (size_t i = order.size(); i > 1; i--)
+        swap(order[i - 1], order[rand() % i]);
+
+    bool agreed = true;
+    for (uint32_t p : order) {
+        bool fresh = left.erase(p) > 0;
+        agreed = agreed && parts.mark(p) == fresh && parts.has(p) &&
+                 parts.remaining() == left.size();
+
+        vector<uint32_t> expected;
+        for (uint32_t q : left) {
+            if (!expected.empty() && expected.back() + 1 == q)
+                expected.back() = q;
+            else
+                expected.insert(expected.end(), {q, q});
+        }
+        agreed = agreed && gaps(parts, nparts) == expected;
+        if (!agreed) break;
+    }
+    EXPECT(agreed);
+    EXPECT(parts.complete());
+}
+
+int main() {
+    testOutOfOrder();
+    testTiny();
+    testShuffled(64, 1);
+    testShuffled(200, 2);
+    testShuffled(1000, 3);
+    return testResult("reassemblytest");
+}
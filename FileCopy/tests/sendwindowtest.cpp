@@ -0,0 +1,130 @@
+#include <cstdlib>
+#include <map>
+#include <vector>
+
+#include "../sendwindow.h"
+#include "../settings.h"
+#include "check.h"
+
+using namespace std;
+
+// The seqnos forEach visits, in order
+template <typename W>
+static vector<seq_t> contents(W &window) {
+    vector<seq_t> seqnos;
+    window.forEach([&seqnos](seq_t seqno, int &) { seqnos.push_back(seqno); });
+    return seqnos;
+}
+
+// Retiring out of order only moves base() once the oldest goes, and then
+// past everything already retired
+static void testBase() {
+    SendWindow<int, 64> window;
+    window.reset(100);
+    EXPECT(window.empty());
+    EXPECT(window.base() == 100);
+    for (seq_t s = 100; s < 110; s++) window.insert(s, s * 10);
+    EXPECT(window.size() == 10);
+
+    window.erase(103);
+    window.erase(101);
+    window.erase(102);
+    EXPECT(window.base() == 100);
+    EXPECT(window.find(101) == nullptr);
+    EXPECT(*window.find(104) == 1040);
+    window.erase(100);
+    EXPECT(window.base() == 104);
+    EXPECT(window.size() == 6);
+    EXPECT((contents(window) == vector<seq_t>{104, 105, 106, 107, 108, 109}));
+
+    window.erase(105);  // again from the middle
+    window.erase(105);  // twice is harmless
+    EXPECT(window.size() == 5);
+    EXPECT(window.find(99) == nullptr && window.find(110) == nullptr);
+
+    // emptied, base is one past the newest
+    for (seq_t s : {109, 104, 107, 106, 108}) window.erase(s);
+    EXPECT(window.empty());
+    EXPECT(window.base() == 110);
+    EXPECT(contents(window).empty());
+
+    // erasing during forEach
+    for (seq_t s = 110; s < 120; s++) window.insert(s, 0);
+    window.forEach([&window](seq_t seqno, int &) {
+        if (seqno % 2) window.erase(seqno);
+    });
+    EXPECT((contents(window) == vector<seq_t>{110, 112, 114, 116, 118}));
+}
+
+// A window kept nearly full while its seqnos go around the ring many
+// times, against a map doing the same
+template <size_t N>
+static void testWraparound(unsigned seed) {
+    SendWindow<seq_t, N> window;
+    map<seq_t, seq_t> model;
+    srand(seed);
+    seq_t next = N - 5;  // the first lap starts just short of the end
+    window.reset(next);
+    for (int round = 0; round < 20 * (int)N; round++) {
+        // fill up to N seqnos past the base, then retire some at random,
+        // oldest more often, as ACKs would
+        while (next - window.base() < (seq_t)N && rand() % 4) {
+            window.insert(next, next * 3);
+            model[next] = next * 3;
+            next++;
+        }
+        if (!model.empty()) {
+            seq_t victim = rand() % 3 ? model.begin()->first
+                                      : next - 1 - rand() % (int)N;
+            window.erase(victim);
+            model.erase(victim);
+        }
+        if (window.size() != model.size()) break;
+        seq_t base = model.empty() ? next : model.begin()->first;
+        if (window.base() != base) break;
+    }
+    EXPECT(window.size() == model.size());
+    EXPECT(window.base() == (model.empty() ? next : model.begin()->first));
+    EXPECT(next > 10 * (seq_t)N);  // went around plenty
+
+    vector<seq_t> expected;
+    bool found = true;
+    for (auto &entry : model) {
+        expected.push_back(entry.first);
+        seq_t *value = window.find(entry.first);
+        found = found && value && *value == entry.second;
+    }
+    EXPECT(found);
+    EXPECT(contents(window) == expected);
+}
+
+// The ring at its full span: N seqnos in flight, the last one in the slot
+// right before the first
+static void testFullSpan() {
+    const size_t N = MAX_SEND_WINDOW;
+    SendWindow<seq_t, N> window;
+    seq_t first = 3 * N + 7;
+    window.reset(first);
+    for (seq_t s = first; s < first + (seq_t)N; s++) window.insert(s, s);
+    EXPECT(window.size() == N);
+    EXPECT(*window.find(first) == first);
+    EXPECT(*window.find(first + N - 1) == first + (seq_t)N - 1);
+    EXPECT(window.find(first + N) == nullptr);
+    EXPECT(window.find(first - 1) == nullptr);
+
+    window.erase(first);
+    window.insert(first + N, first + N);  // takes the slot first had
+    EXPECT(window.base() == first + 1);
+    EXPECT(*window.find(first + N) == first + (seq_t)N);
+    EXPECT(window.find(first) == nullptr);
+    EXPECT(contents(window).front() == first + 1);
+    EXPECT(contents(window).back() == first + (seq_t)N);
+}
+
+int main() {
+    testBase();
+    testWraparound<64>(1);
+    testWraparound<MAX_SEND_WINDOW>(2);
+    testFullSpan();
+    return testResult("sendwindowtest");
+}
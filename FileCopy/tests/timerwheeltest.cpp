@@ -0,0 +1,125 @@
+#include <chrono>
+#include <vector>
+
+#include "../timerwheel.h"
+#include "check.h"
+
+using namespace std;
+
+typedef TimerWheel::clock clock_;
+
+// Advances the wheel to when and runs the callbacks that came due, the way
+// the event loop does. Returns how many ran.
+static int fire(TimerWheel &wheel, clock_::time_point when) {
+    vector<TimerWheel::TimerId> due;
+    wheel.advance(when, due);
+    int ran = 0;
+    for (TimerWheel::TimerId id : due) {
+        TimerWheel::Callback cb;
+        if (!wheel.take(id, cb)) continue;
+        cb();
+        ran++;
+    }
+    return ran;
+}
+
+static chrono::milliseconds ms(long n) { return chrono::milliseconds(n); }
+
+// A timer d ms out fires neither early nor more than a tick late, whichever
+// levels it has to come down through on the way
+static void testDeadline(long d) {
+    TimerWheel wheel;
+    clock_::time_point t0 = clock_::now();
+    int fired = 0;
+    wheel.add(t0 + ms(d), [&fired]() { fired++; });
+    EXPECT(wheel.pending() == 1);
+
+    // in steps, so the wheel comes around to the timer's slot on the way
+    for (long t = 0; t < d - 1; t += 1000) fire(wheel, t0 + ms(t));
+    fire(wheel, t0 + ms(d - 1));
+    if (fired != 0) fprintf(stderr, "%ld ms timer fired early\n", d);
+    EXPECT(fired == 0);
+    EXPECT(wheel.nextDue() <= t0 + ms(d + 1));
+
+    fire(wheel, t0 + ms(d + 1));
+    if (fired != 1) fprintf(stderr, "%ld ms timer didn't fire\n", d);
+    EXPECT(fired == 1);
+    EXPECT(wheel.pending() == 0);
+    EXPECT(wheel.nextDue() == clock_::time_point::max());
+}
+
+// Cancelling a timer after it was moved down a level
+static void testCancelAfterCascade() {
+    TimerWheel wheel;
+    clock_::time_point t0 = clock_::now();
+    int fired = 0;
+    TimerWheel::TimerId id =
+        wheel.add(t0 + ms(4096 + 100), [&fired]() { fired++; });
+    TimerWheel::TimerId other =
+        wheel.add(t0 + ms(4096 + 200), [&fired]() { fired += 10; });
+    fire(wheel, t0 + ms(4096 + 10));  // past the level 2 boundary
+    EXPECT(fired == 0);
+    wheel.cancel(id);
+    EXPECT(wheel.pending() == 1);
+    wheel.cancel(id);  // again is harmless
+    EXPECT(wheel.pending() == 1);
+    fire(wheel, t0 + ms(4096 + 300));
+    EXPECT(fired == 10);
+    wheel.cancel(other);  // already fired, also harmless
+    EXPECT(wheel.pending() == 0);
+}
+
+// A callback that arms its own timer again, like a resend timer does
+static void testRearmInCallback() {
+    TimerWheel wheel;
+    clock_::time_point t0 = clock_::now();
+    int fired = 0;
+    clock_::time_point next = t0 + ms(10);
+    function<void()> tick = [&]() {
+        fired++;
+        next += ms(100);
+        if (fired < 5) wheel.add(next, tick);
+    };
+    wheel.add(next, tick);
+    for (long t = 0; t <= 1000; t++) fire(wheel, t0 + ms(t));
+    EXPECT(fired == 5);
+    EXPECT(wheel.pending() == 0);
+
+    // re-armed for a time already gone, it waits for the next advance
+    fired = 0;
+    clock_::time_point then = t0 + ms(2000);
+    wheel.add(then, [&]() {
+        fired++;
+        wheel.add(then, [&fired]() { fired++; });
+    });
+    EXPECT(fire(wheel, then + ms(1)) == 1);
+    EXPECT(fired == 1);
+    EXPECT(fire(wheel, then + ms(1)) == 1);
+    EXPECT(fired == 2);
+}
+
+// A callback cancelling another one that came due with it
+static void testCancelFromCallback() {
+    TimerWheel wheel;
+    clock_::time_point t0 = clock_::now();
+    int fired = 0;
+    TimerWheel::TimerId second = 0;
+    wheel.add(t0 + ms(50), [&]() {
+        fired++;
+        wheel.cancel(second);
+    });
+    second = wheel.add(t0 + ms(50), [&fired]() { fired += 10; });
+    EXPECT(fire(wheel, t0 + ms(60)) == 1);
+    EXPECT(fired == 1);
+}
+
+int main() {
+    // either side of the level boundaries, and past the top level
+    for (long d : {1L, 63L, 64L, 65L, 4095L, 4096L, 4097L, 262143L, 262144L,
+                   262145L, 16777216L + 5})
+        testDeadline(d);
+    testCancelAfterCascade();
+    testRearmInCallback();
+    testCancelFromCallback();
+    return testResult("timerwheeltest");
+}
@@ -0,0 +1,194 @@
+#include "timerwheel.h"
+
+#include <algorithm>
+#include <utility>
+
+using namespace std;
+
+// 4 levels of 64 slots reach 2^24ms (4.6 hours) ahead. Timers further out
+// than that wait in the top level's last slot, and go around again.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+
+static const uint64_t WHEEL_SPAN = 1ull << (WHEEL_BITS * WHEEL_LEVELS);
+static const uint32_t DUE_LIST = WHEEL_LEVELS * WHEEL_SLOTS;
+static const uint32_t NUM_HEADS = DUE_LIST + 1;
+static const uint32_t NIL = UINT32_MAX;
+
+static uint64_t makeId(uint32_t generation, uint32_t i) {
+    return ((uint64_t)generation << 32) | i;
+}
+
+TimerWheel::TimerWheel() {
+    m_nodes.resize(NUM_HEADS);
+    for (uint32_t i = 0; i < NUM_HEADS; i++) {
+        m_nodes[i].prev = m_nodes[i].next = i;
+        m_nodes[i].state = IDLE;
+    }
+    m_free = NIL;
+    m_start = clock::now();
+    m_now = 0;
+    m_pending = 0;
+}
+
+uint64_t TimerWheel::ceilTick(clock::time_point t) const {
+    if (t <= m_start) return 0;
+    auto ms = chrono::ceil<chrono::milliseconds>(t - m_start);
+    return ms.count();
+}
+
+uint64_t TimerWheel::floorTick(clock::time_point t) const {
+    if (t <= m_start) return 0;
+    auto ms = chrono::floor<chrono::milliseconds>(t - m_start);
+    return ms.count();
+}
+
+TimerWheel::TimerId TimerWheel::add(clock::time_point when, Callback cb) {
+    uint32_t i = allocate();
+    Node &n = m_nodes[i];
+    n.state = PENDING;
+    n.expires = ceilTick(when);
+    n.cb = move(cb);
+    place(i);
+    m_pending++;
+    return makeId(n.generation, i);
+}
+
+void TimerWheel::cancel(TimerId id) {
+    uint32_t i = (uint32_t)id;
+    if (i < NUM_HEADS || i >= m_nodes.size()) return;
+    Node &n = m_nodes[i];
+    if (n.generation != (uint32_t)(id >> 32) || n.state == IDLE) return;
+    if (n.state == PENDING) {
+        unlink(i);
+        m_pending--;
+    }
+    release(i);
+}
+
+TimerWheel::clock::time_point TimerWheel::nextDue() const {
+    if (m_pending == 0) return clock::time_point::max();
+    if (!isEmpty(DUE_LIST)) return m_start + chrono::milliseconds(m_now);
+
+    // Level 0 slots hold exact ticks. A slot further up holds anything
+    // from the tick the wheel gets around to it, when it has to wake up
+    // anyway to move them down.
+    uint64_t best = UINT64_MAX;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        for (uint64_t k = 1; k <= WHEEL_SLOTS; k++) {
+            uint64_t tick = ((m_now >> shift) + k) << shift;
+            if (tick >= best) break;
+            uint32_t slot = ((m_now >> shift) + k) & (WHEEL_SLOTS - 1);
+            if (!isEmpty(level * WHEEL_SLOTS + slot)) {
+                best = tick;
+                break;
+            }
+        }
+    }
+    return m_start + chrono::milliseconds(best);
+}
+
+void TimerWheel::advance(clock::time_point now, vector<TimerId> &due) {
+    uint64_t target = floorTick(now);
+    collect(DUE_LIST, due);
+    while (m_now < target) {
+        if (m_pending == 0) {  // nothing to move, skip ahead
+            m_now = target;
+            break;
+        }
+        m_now++;
+        // Every time a level comes all the way around, the next slot of
+        // the level above moves down
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            int shift = WHEEL_BITS * level;
+            if (m_now & ((1ull << shift) - 1)) break;
+            uint32_t slot = (m_now >> shift) & (WHEEL_SLOTS - 1);
+            uint32_t list = level * WHEEL_SLOTS + slot;
+            while (!isEmpty(list)) {
+                uint32_t i = m_nodes[list].next;
+                unlink(i);
+                place(i);
+            }
+        }
+        collect(m_now & (WHEEL_SLOTS - 1), due);
+        collect(DUE_LIST, due);
+    }
+}
+
+bool TimerWheel::take(TimerId id, Callback &cb) {
+    uint32_t i = (uint32_t)id;
+    if (i < NUM_HEADS || i >= m_nodes.size()) return false;
+    Node &n = m_nodes[i];
+    if (n.generation != (uint32_t)(id >> 32) || n.state != FIRING)
+        return false;
+    cb = move(n.cb);
+    release(i);
+    return true;
+}
+
+void TimerWheel::place(uint32_t i) {
+    uint64_t expires = m_nodes[i].expires;
+    if (expires <= m_now) {
+        link(DUE_LIST, i);
+        return;
+    }
+    uint64_t at = min(expires, m_now + WHEEL_SPAN - 1);
+    uint64_t delta = at - m_now;
+    int level = 0;
+    while (delta >= (1ull << (WHEEL_BITS * (level + 1)))) level++;
+    uint32_t slot = (at >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1);
+    link(level * WHEEL_SLOTS + slot, i);
+}
+
+void TimerWheel::collect(uint32_t list, vector<TimerId> &due) {
+    while (!isEmpty(list)) {
+        uint32_t i = m_nodes[list].next;
+        unlink(i);
+        m_nodes[i].state = FIRING;
+        m_pending--;
+        due.push_back(makeId(m_nodes[i].generation, i));
+    }
+}
+
+void TimerWheel::link(uint32_t list, uint32_t i) {
+    Node &head = m_nodes[list];
+    Node &n = m_nodes[i];
+    n.prev = head.prev;
+    n.next = list;
+    m_nodes[head.prev].next = i;
+    head.prev = i;
+}
+
+void TimerWheel::unlink(uint32_t i) {
+    Node &n = m_nodes[i];
+    m_nodes[n.prev].next = n.next;
+    m_nodes[n.next].prev = n.prev;
+    n.prev = n.next = i;
+}
+
+uint32_t TimerWheel::allocate() {
+    if (m_free == NIL) {
+        Node n;
+        n.prev = n.next = m_nodes.size();
+        n.generation = 0;
+        n.state = IDLE;
+        n.expires = 0;
+        m_nodes.push_back(move(n));
+        return m_nodes.size() - 1;
+    }
+    uint32_t i = m_free;
+    m_free = m_nodes[i].next;
+    m_nodes[i].prev = m_nodes[i].next = i;
+    return i;
+}
+
+void TimerWheel::release(uint32_t i) {
+    Node &n = m_nodes[i];
+    n.cb = nullptr;
+    n.state = IDLE;
+    n.generation++;
+    n.next = m_free;
+    m_free = i;
+}
@@ -0,0 +1,89 @@
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hierarchical timing wheel (Varghese & Lauck), the timers behind the
+// event loop.
+//
+// Time goes by in 1ms ticks. Level 0 has a slot for each of the next
+// WHEEL_SLOTS ticks, and each level above has slots WHEEL_SLOTS times as
+// wide. A timer goes in the slot of the lowest level that reaches its
+// deadline, and moves down a level whenever the wheel comes around to its
+// slot, so add() and cancel() are O(1) however many timers there are (tens
+// of thousands of in-flight packets, each with its own resend deadline),
+// and advancing costs O(1) per tick plus O(1) per timer per level.
+//
+// Timers never fire early, but may fire up to a tick late.
+class TimerWheel {
+   public:
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void()> Callback;
+    typedef uint64_t TimerId;  // never 0
+
+    TimerWheel();
+
+    TimerId add(clock::time_point when, Callback cb);
+
+    // Forgets a timer. Harmless if it already fired or was cancelled.
+    void cancel(TimerId id);
+
+    // Number of timers that haven't come due yet
+    size_t pending() const { return m_pending; }
+
+    // Earliest time some timer may come due (it may also be later, when
+    // the wheel only needs to move timers down a level), or
+    // clock::time_point::max() if there are no timers
+    clock::time_point nextDue() const;
+
+    // Moves the wheel up to now and appends the ids of the timers that came
+    // due to due. Their callbacks are then claimed with take(), so that one
+    // callback can still cancel another that came due with it.
+    void advance(clock::time_point now, std::vector<TimerId> &due);
+
+    // Hands over the callback of a timer advance() said came due, and
+    // forgets the timer. False if it was cancelled since.
+    bool take(TimerId id, Callback &cb);
+
+   private:
+    enum NodeState { IDLE, PENDING, FIRING };
+
+    // A timer, or the head of a list of them. Lists are circular and
+    // doubly linked by index into m_nodes.
+    struct Node {
+        uint32_t prev, next;
+        uint32_t generation;  // tells reuses of the node apart in TimerIds
+        NodeState state;
+        uint64_t expires;  // tick
+        Callback cb;
+    };
+
+    uint64_t ceilTick(clock::time_point t) const;
+    uint64_t floorTick(clock::time_point t) const;
+
+    // Puts a pending timer in the slot (or the due list) for its tick
+    void place(uint32_t i);
+
+    // Marks every timer in the list as FIRING and appends their ids to due
+    void collect(uint32_t list, std::vector<TimerId> &due);
+
+    void link(uint32_t list, uint32_t i);
+    void unlink(uint32_t i);
+    bool isEmpty(uint32_t list) const { return m_nodes[list].next == list; }
+    uint32_t allocate();
+    void release(uint32_t i);
+
+    // The first nodes are list heads: every slot of every level, then the
+    // list of timers that are due but not collected yet
+    std::vector<Node> m_nodes;
+    uint32_t m_free;  // free list of nodes, linked by next
+
+    clock::time_point m_start;  // tick 0
+    uint64_t m_now;             // the tick the wheel has been advanced to
+    size_t m_pending;
+};
+
+#endif
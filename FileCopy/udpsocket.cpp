@@ -0,0 +1,234 @@
+#include "udpsocket.h"
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "c150debug.h"
+
+using namespace std;
+using namespace C150NETWORK;
+
+static string errorString() { return "\"" + string(strerror(errno)) + "\""; }
+
+// The nasty socket keeps its descriptor to itself. Creating it is the
+// first thing its constructor does, so it gets the lowest descriptor that
+// is free just before (sockets must therefore be set up before other
+// threads open files).
+static int nextDescriptor() {
+    int fd = open("/dev/null", O_RDONLY);
+    if (fd < 0)
+        throw C150NetworkException("UdpSocket: can't open /dev/null " +
+                                   errorString());
+    close(fd);
+    return fd;
+}
+
+UdpSocket::UdpSocket(int nastiness, char *server) {
+    m_nastiness = nastiness;
+    m_pmtudisc = -1;
+    m_fd = nextDescriptor();
+    m_sock = new C150NastyDgmSocket(nastiness);
+    adopt();
+    m_sock->setServerName(server);  // throws if server can't be resolved
+
+    struct hostent *host = gethostbyname(server);
+    memset(&m_server, 0, sizeof(m_server));
+    m_server.sin_family = AF_INET;
+    memcpy(&m_server.sin_addr.s_addr, host->h_addr, host->h_length);
+    m_server.sin_port = htons(getUserPort());
+
+    // The nasty socket only reads once it has written something. An empty
+    // datagram does, and the server ignores it.
+    if (m_nastiness > 0) m_sock->write("", 0);
+}
+
+UdpSocket::UdpSocket(int nastiness, bool reusePort) {
+    m_nastiness = nastiness;
+    m_pmtudisc = -1;
+    m_fd = nextDescriptor();
+    m_sock = new C150NastyDgmSocket(nastiness);
+    adopt();
+    memset(&m_server, 0, sizeof(m_server));
+
+    if (reusePort) {
+        int on = 1;
+        if (setsockopt(m_fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+            throw C150NetworkException(
+                "UdpSocket: couldn't set SO_REUSEPORT " + errorString());
+    }
+
+    // The nasty socket binds to the user's port at its first read. Nobody
+    // knows about us yet, so that read has nothing to lose.
+    char scratch[MAXDGMSIZE];
+    m_sock->read(scratch, sizeof(scratch));
+}
+
+UdpSocket::~UdpSocket() { delete m_sock; }
+
+void UdpSocket::adopt() {
+    int type;
+    socklen_t len = sizeof(type);
+    if (getsockopt(m_fd, SOL_SOCKET, SO_TYPE, &type, &len) < 0 ||
+        type != SOCK_DGRAM)
+        throw C150NetworkException(
+            "UdpSocket: couldn't find the datagram socket's descriptor");
+
+    int flags = fcntl(m_fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(m_fd, F_SETFL, flags | O_NONBLOCK) < 0)
+        throw C150NetworkException("UdpSocket: couldn't make socket "
+                                   "non-blocking " +
+                                   errorString());
+    // With a timeout set, the nasty socket's read() takes "nothing there"
+    // for a timeout instead of an error
+    m_sock->turnOnTimeouts(1);
+}
+
+int UdpSocket::readMany(char *bufs[], ssize_t lenToRead, ssize_t lens[],
+                        int maxmsgs, struct sockaddr_in from[]) {
+    int n = 0;
+    if (m_nastiness > 0) {
+        // One at a time through the nasty socket. Peek at each datagram
+        // first to learn its sender, and keep what read() returns only if
+        // it is that datagram.
+        lenToRead = min(lenToRead, MAXDGMSIZE);
+        for (int i = 0; i < maxmsgs; i++) {
+            struct sockaddr_in sender;
+            socklen_t senderlen = sizeof(sender);
+            ssize_t peeked = -1;
+            if (from)
+                peeked = recvfrom(m_fd, m_peek, sizeof(m_peek),
+                                  MSG_PEEK | MSG_TRUNC,
+                                  (struct sockaddr *)&sender, &senderlen);
+            ssize_t len = m_sock->read(bufs[n], lenToRead);
+            if (m_sock->timedout()) break;
+            if (len <= 0) continue;  // a client's hello
+            if (from) {
+                if (peeked != len || memcmp(m_peek, bufs[n], len) != 0) {
+                    c150debug->printf(C150APPLICATION,
+                                      "Dropped a datagram of %d bytes with "
+                                      "no known sender\n",
+                                      (int)len);
+                    continue;
+                }
+                from[n] = sender;
+            }
+            lens[n++] = len;
+        }
+        return n;
+    }
+
+    vector<struct mmsghdr> msgs(maxmsgs);
+    vector<struct iovec> iovs(maxmsgs);
+    memset(msgs.data(), 0, maxmsgs * sizeof(struct mmsghdr));
+    for (int i = 0; i < maxmsgs; i++) {
+        iovs[i].iov_base = bufs[i];
+        iovs[i].iov_len = lenToRead;
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        if (from) {
+            msgs[i].msg_hdr.msg_name = &from[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(from[i]);
+        }
+    }
+    int nread = recvmmsg(m_fd, msgs.data(), maxmsgs, 0, NULL);
+    if (nread < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0;
+        throw C150NetworkException("UdpSocket::readMany: error reading " +
+                                   errorString());
+    }
+
+    // Keep datagrams i we want at n, moving the odd one down
+    for (int i = 0; i < nread; i++) {
+        size_t len = msgs[i].msg_len;
+        if (len == 0) continue;  // a client's hello
+        if (from && msgs[i].msg_hdr.msg_namelen == 0) continue;
+        if (n != i) {
+            memcpy(bufs[n], bufs[i], len);
+            if (from) from[n] = from[i];
+        }
+        lens[n++] = len;
+    }
+    return n;
+}
+
+bool UdpSocket::writeMany(const char *const bufs[], const ssize_t lens[],
+                          int nmsgs, const struct sockaddr_in *to) {
+    vector<struct iovec> iovs(nmsgs);
+    vector<int> iovcnts(nmsgs, 1);
+    for (int i = 0; i < nmsgs; i++) {
+        iovs[i].iov_base = (void *)bufs[i];
+        iovs[i].iov_len = lens[i];
+    }
+    return writeMany(iovs.data(), iovcnts.data(), nmsgs, to);
+}
+
+bool UdpSocket::writeMany(const struct iovec iovs[], const int iovcnts[],
+                          int nmsgs, const struct sockaddr_in *to) {
+    if (nmsgs <= 0) return true;
+    if (!to) to = &m_server;
+
+    vector<struct mmsghdr> msgs(nmsgs);
+    memset(msgs.data(), 0, nmsgs * sizeof(struct mmsghdr));
+    const struct iovec *iov = iovs;
+    for (int i = 0; i < nmsgs; i++) {
+        msgs[i].msg_hdr.msg_iov = (struct iovec *)iov;
+        msgs[i].msg_hdr.msg_iovlen = iovcnts[i];
+        msgs[i].msg_hdr.msg_name = (void *)to;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+        iov += iovcnts[i];
+    }
+
+    // sendmmsg may stop early, keep going from wherever it stopped
+    bool fit = true;
+    int sent = 0;
+    while (sent < nmsgs) {
+        int n = sendmmsg(m_fd, msgs.data() + sent, nmsgs - sent, 0);
+        if (n >= 0) {
+            sent += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // out of buffer room, wait for some
+            struct pollfd pfd = {m_fd, POLLOUT, 0};
+            poll(&pfd, 1, -1);
+        } else if (errno == EMSGSIZE) {
+            fit = false;  // the first one left is too big, skip it
+            sent++;
+        } else if (errno != EINTR) {
+            throw C150NetworkException("UdpSocket::writeMany: error writing " +
+                                       errorString());
+        }
+    }
+    return fit;
+}
+
+void UdpSocket::sizeBuffers(size_t dgmsize) {
+    // Best effort only, the kernel may cap these
+    int bufsize = 64 * dgmsize;
+    setsockopt(m_fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+    setsockopt(m_fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+}
+
+bool UdpSocket::setDontFragment(bool on) {
+#ifdef IP_MTU_DISCOVER
+    socklen_t len = sizeof(m_pmtudisc);
+    if (on && m_pmtudisc < 0 &&
+        getsockopt(m_fd, IPPROTO_IP, IP_MTU_DISCOVER, &m_pmtudisc, &len) < 0)
+        return false;
+    if (m_pmtudisc < 0) return !on;  // never turned on
+    int mode = on ? IP_PMTUDISC_DO : m_pmtudisc;
+    if (setsockopt(m_fd, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode)) < 0)
+        return false;
+    if (!on) m_pmtudisc = -1;
+    return true;
+#else
+    return !on;
+#endif
+}
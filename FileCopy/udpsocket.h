@@ -0,0 +1,82 @@
+#ifndef UDPSOCKET_H
+#define UDPSOCKET_H
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "c150nastydgmsocket.h"
+
+// A C150NastyDgmSocket with what the messenger and the listeners need on
+// top of it: batches of datagrams per system call (recvmmsg/sendmmsg),
+// non-blocking use from an event loop, the sender of every datagram,
+// datagrams bigger than MAXDGMSIZE, and SO_REUSEPORT for servers.
+//
+// The c150 classes are used as they are. They work on their own
+// descriptor, which this drives directly alongside them: writes always go
+// out on it, and so do reads when there is no nastiness. With nastiness,
+// every read goes through the nasty socket's read(), one datagram at a
+// time, so none escape its state machine. Those reads are at most
+// MAXDGMSIZE bytes.
+//
+// Errors throw C150NetworkException, like the c150 classes.
+class UdpSocket {
+   public:
+    // A client's socket, talking to the server named server
+    UdpSocket(int nastiness, char *server);
+
+    // A server's socket, bound to the user's port. With reusePort, other
+    // sockets (other listeners) may bind the same port.
+    UdpSocket(int nastiness, bool reusePort);
+
+    ~UdpSocket();
+
+    // For waiting on with an event loop. Never blocks.
+    int fd() const { return m_fd; }
+
+    // Reads whatever datagrams have arrived, up to maxmsgs, without
+    // waiting. Datagram i goes in bufs[i], which must hold lenToRead bytes,
+    // and its length in lens[i]. Returns the number read, 0 if none.
+    //
+    // If from is given, from[i] is who sent datagram i. The nasty socket
+    // may hand back a datagram it held on to instead of the one it just
+    // read, and who sent that one isn't known, so it is dropped.
+    int readMany(char *bufs[], ssize_t lenToRead, ssize_t lens[], int maxmsgs,
+                 struct sockaddr_in from[] = nullptr);
+
+    // Sends datagram i from bufs[i] with length lens[i], to the server for
+    // clients, to *to for servers. Returns false if some datagram was too
+    // big for the network (EMSGSIZE), the rest still go.
+    bool writeMany(const char *const bufs[], const ssize_t lens[], int nmsgs,
+                   const struct sockaddr_in *to = nullptr);
+
+    // The same, gathering each datagram from pieces: datagram i is the next
+    // iovcnts[i] entries of iovs, so a header and its data need not be
+    // copied together first
+    bool writeMany(const struct iovec iovs[], const int iovcnts[], int nmsgs,
+                   const struct sockaddr_in *to = nullptr);
+
+    // Grows the kernel's buffers to hold a burst of datagrams this big
+    void sizeBuffers(size_t dgmsize);
+
+    // With on, datagrams go out with the don't fragment bit set
+    // (IP_PMTUDISC_DO): a datagram bigger than the path MTU is refused, and
+    // writeMany() returns false, or is dropped on the way, instead of
+    // making it across in fragments. Off goes back to how the socket was.
+    // Returns false if the socket doesn't support it.
+    bool setDontFragment(bool on);
+
+   private:
+    // Finds the nasty socket's descriptor and makes it non-blocking
+    void adopt();
+
+    C150NETWORK::C150NastyDgmSocket *m_sock;
+    int m_fd;
+    int m_nastiness;
+    int m_pmtudisc;  // IP_MTU_DISCOVER before setDontFragment(true), or -1
+    struct sockaddr_in m_server;  // clients only
+    // head of the next datagram, to tell whether the nasty socket's read
+    // returns it (and its sender is known) or something it held on to
+    char m_peek[C150NETWORK::MAXDGMSIZE];
+};
+
+#endif
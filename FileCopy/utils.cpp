@@ -1,19 +1,71 @@
 #include "utils.h"
 
 #include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <string>
 
 #include "c150debug.h"
 
 using namespace C150NETWORK;
 using namespace std;
 
-void setUpDebugLogging(const char *logname, int argc, char *argv[]) {
+// The c150 debug stream isn't thread safe, and the server logs from its
+// listener threads and disk workers at once. Whatever a thread writes
+// collects here until the end of its line, and the line then goes to the
+// log whole. (The stream's formatting flags are still shared, so now and
+// then a timestamp may come out padded with blanks instead of zeros.)
+class LineLockedBuf : public streambuf {
+   public:
+    LineLockedBuf(streambuf *out) : m_out(out) {}
+
+   protected:
+    int overflow(int c) override {
+        if (c == EOF) return 0;
+        char ch = c;
+        xsputn(&ch, 1);
+        return c;
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override {
+        string &pending = line();
+        pending.append(s, n);
+        if (pending.find('\n') != string::npos) writeLine();
+        return n;
+    }
+
+    // The debug stream flushes after every << (unitbuf), so only a whole
+    // line is worth flushing
+    int sync() override {
+        if (!line().empty()) return 0;
+        lock_guard<mutex> guard(m_lock);
+        return m_out->pubsync();
+    }
+
+   private:
+    static string &line() {
+        thread_local string pending;
+        return pending;
+    }
+
+    void writeLine() {
+        string &pending = line();
+        lock_guard<mutex> guard(m_lock);
+        m_out->sputn(pending.data(), pending.size());
+        pending.clear();
+    }
+
+    streambuf *m_out;
+    mutex m_lock;
+};
+
+void setUpDebugLogging(const char *logname, int /* argc */, char *argv[]) {
     //
     //           Choose where debug output should go
     //
     // The default is that debug output goes to cerr.
     //
-    // Uncomment the following three lines to direct
+    // Uncomment the following four lines to direct
     // debug output to a file. Comment them
     // to default to the console.
     //
@@ -27,16 +79,20 @@ void setUpDebugLogging(const char *logname, int argc, char *argv[]) {
     //     The first line is ordinary C++ to open a file
     //     as an output stream.
     //
-    //     The second line wraps that will all the services
+    //     The second line has whole lines, one thread's at a time, go
+    //     to the file (see LineLockedBuf above).
+    //
+    //     The third line wraps that will all the services
     //     of a comp 150-IDS debug stream, and names that filestreamp.
     //
-    //     The third line replaces the global variable c150debug
+    //     The fourth line replaces the global variable c150debug
     //     and sets it to point to the new debugstream. Since c150debug
     //     is what all the c150 debug routines use to find the debug stream,
     //     you've now effectively overridden the default.
     //
     ofstream *outstreamp = new ofstream(logname);
-    DebugStream *filestreamp = new DebugStream(outstreamp);
+    ostream *linestreamp = new ostream(new LineLockedBuf(outstreamp->rdbuf()));
+    DebugStream *filestreamp = new DebugStream(linestreamp);
     DebugStream::setDefaultLogger(filestreamp);
 
     //